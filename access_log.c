@@ -0,0 +1,308 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "access_log.h"
+
+#define RING_MASK (ACCESS_LOG_RING_SIZE - 1)
+#define CACHE_LINE 64
+#define LINE_MAX_LEN (4 * (ACCESS_LOG_METHOD_MAX + ACCESS_LOG_TARGET_MAX) + 512)   //escaping can grow a byte to four
+
+// One producer (the thread that owns it) and one consumer (the writer).
+// The cursors only grow; a slot is free once head has passed it.
+typedef struct log_ring_st {
+    _Alignas(CACHE_LINE) atomic_uint tail;      //next slot the producer fills
+    atomic_ulong dropped;
+    _Alignas(CACHE_LINE) atomic_uint head;      //next slot the writer reads
+    atomic_int owned;               //1 while a live thread produces into it
+    struct log_ring_st* next;
+    access_record records[ACCESS_LOG_RING_SIZE];
+} log_ring;
+
+// Every ring ever created, newest first; only ever pushed to. A thread
+// that exits leaves its ring to the next thread that starts logging.
+static _Atomic(log_ring*) all_rings = NULL;
+static _Thread_local log_ring* local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static int enabled = 0;
+static char* log_path = NULL;
+static int log_fd = -1;
+static pthread_t writer;
+static atomic_int running;
+static atomic_int reopen_requested;
+static atomic_ulong written;
+
+static void release_ring(void* p) {
+    atomic_store(&((log_ring*)p)->owned, 0);
+}
+
+static void create_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static log_ring* thread_ring(void) {
+    log_ring* ring = local_ring;
+    if (ring) {
+        return ring;
+    }
+
+    for (ring = atomic_load(&all_rings); ring; ring = ring->next) {
+        int unowned = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &unowned, 1)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = (log_ring*)aligned_alloc(CACHE_LINE, sizeof(log_ring));
+        if (!ring) {
+            return NULL;    // this thread goes unlogged
+        }
+        memset(ring, 0, sizeof(log_ring));
+        atomic_init(&ring->owned, 1);
+        ring->next = atomic_load(&all_rings);
+        while (!atomic_compare_exchange_weak(&all_rings, &ring->next, ring)) {
+        }
+    }
+    local_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+access_record* access_log_reserve(void) {
+    if (!enabled) {
+        return NULL;
+    }
+    log_ring* ring = thread_ring();
+    if (!ring) {
+        return NULL;
+    }
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= ACCESS_LOG_RING_SIZE) {
+        // Only the owner writes the counter, so no locked instruction is needed
+        atomic_store_explicit(&ring->dropped,
+                              atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return NULL;
+    }
+    return &ring->records[tail & RING_MASK];
+}
+
+void access_log_commit(access_record* rec) {
+    (void)rec;
+    log_ring* ring = local_ring;
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Copies s, turning quotes, backslashes and non-printable bytes into \xHH
+static size_t escape(char* out, const char* s) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = 'x';
+            out[len++] = hex[c >> 4];
+            out[len++] = hex[c & 0xf];
+        }
+        else {
+            out[len++] = (char)c;
+        }
+    }
+    return len;
+}
+
+// [17/Oct/2026:10:00:00 +0000], formatted once per second
+static const char* clf_time(int64_t time_s) {
+    static int64_t cached_s = -1;
+    static char cached[40];
+    if (time_s != cached_s) {
+        time_t t = (time_t)time_s;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(cached, sizeof(cached), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+        cached_s = time_s;
+    }
+    return cached;
+}
+
+// One line, at most LINE_MAX_LEN bytes
+static size_t format_record(const access_record* rec, char* out) {
+    char addr[INET6_ADDRSTRLEN] = "-";
+    if (rec->peer.sa.sa_family == AF_INET) {
+        inet_ntop(AF_INET, &rec->peer.v4.sin_addr, addr, sizeof(addr));
+    }
+    else if (rec->peer.sa.sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &rec->peer.v6.sin6_addr, addr, sizeof(addr));
+    }
+
+    size_t len = (size_t)snprintf(out, LINE_MAX_LEN, "%s - - %s \"", addr, clf_time(rec->time_s));
+    if (rec->method[0]) {
+        len += escape(out + len, rec->method);
+        out[len++] = ' ';
+        len += escape(out + len, rec->target);
+        len += (size_t)snprintf(out + len, LINE_MAX_LEN - len, " HTTP/%d.%d",
+                                rec->major_version, rec->minor_version);
+    }
+    else {
+        out[len++] = '-';
+    }
+
+    char status[16] = "-";
+    if (rec->status) {
+        snprintf(status, sizeof(status), "%d", rec->status);
+    }
+    len += (size_t)snprintf(out + len, LINE_MAX_LEN - len,
+        "\" %s %llu queue_us=%llu parse_us=%llu resolve_us=%llu handle_us=%llu write_us=%llu total_us=%llu\n",
+        status, (unsigned long long)rec->bytes,
+        (unsigned long long)(rec->stage_ns[METRIC_QUEUE_WAIT] / 1000),
+        (unsigned long long)(rec->stage_ns[METRIC_PARSE] / 1000),
+        (unsigned long long)(rec->stage_ns[METRIC_RESOLVE] / 1000),
+        (unsigned long long)(rec->stage_ns[METRIC_HANDLE] / 1000),
+        (unsigned long long)(rec->stage_ns[METRIC_WRITE] / 1000),
+        (unsigned long long)(rec->stage_ns[METRIC_REQUEST] / 1000));
+    return len;
+}
+
+static void write_out(const char* data, size_t len) {
+    while (len > 0 && log_fd >= 0) {
+        ssize_t n = write(log_fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("access log write");
+            return;     // the batch is lost, later ones may still get through
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static int open_log(const char* path) {
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+// The old file was renamed away; keep writing to it if a new one can't be made
+static void reopen_log(void) {
+    int fd = open_log(log_path);
+    if (fd < 0) {
+        perror("access log reopen");
+        return;
+    }
+    close(log_fd);
+    log_fd = fd;
+}
+
+static void* run_writer(void* arg) {
+    char* batch = (char*)arg;
+    while (1) {
+        // Checked before draining, so the last pass picks up everything
+        int stopping = !atomic_load(&running);
+        if (atomic_exchange(&reopen_requested, 0)) {
+            reopen_log();
+        }
+
+        size_t len = 0;
+        unsigned long lines = 0;
+        for (log_ring* ring = atomic_load(&all_rings); ring; ring = ring->next) {
+            unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            for (; head != tail; head++) {
+                if (len > ACCESS_LOG_BATCH_SIZE - LINE_MAX_LEN) {
+                    write_out(batch, len);
+                    len = 0;
+                }
+                len += format_record(&ring->records[head & RING_MASK], batch + len);
+                lines++;
+                atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            }
+        }
+        write_out(batch, len);
+        atomic_fetch_add(&written, lines);
+
+        if (stopping) {
+            break;
+        }
+        if (lines == 0) {
+            struct timespec pause = { 0, ACCESS_LOG_INTERVAL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+int access_log_open(const char* path) {
+    pthread_once(&key_once, create_key);
+    log_path = strdup(path);
+    char* batch = (char*)malloc(ACCESS_LOG_BATCH_SIZE);
+    if (!log_path || !batch) {
+        perror("malloc");
+        goto fail;
+    }
+    log_fd = open_log(path);
+    if (log_fd < 0) {
+        perror(path);
+        goto fail;
+    }
+
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, run_writer, batch) != 0) {
+        perror("pthread_create");
+        close(log_fd);
+        log_fd = -1;
+        goto fail;
+    }
+    enabled = 1;
+    return 0;
+
+fail:
+    free(batch);
+    free(log_path);
+    log_path = NULL;
+    return -1;
+}
+
+int access_log_enabled(void) {
+    return enabled;
+}
+
+void access_log_reopen(void) {
+    atomic_store(&reopen_requested, 1);
+}
+
+void access_log_close(void) {
+    if (!enabled) {
+        return;
+    }
+    enabled = 0;
+    atomic_store(&running, 0);
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+    free(log_path);
+    log_path = NULL;
+}
+
+unsigned long access_log_dropped(void) {
+    unsigned long total = 0;
+    for (log_ring* ring = atomic_load(&all_rings); ring; ring = ring->next) {
+        total += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return total;
+}
+
+unsigned long access_log_written(void) {
+    return atomic_load(&written);
+}
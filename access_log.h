@@ -0,0 +1,96 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "metrics.h"
+
+/**
+ * access_log.h
+ *
+ * Access log that keeps the disk and stdio locks off the request path.
+ * A worker fills a fixed-size record in a ring of its own, without
+ * locks or locked instructions, and goes on. A writer thread drains
+ * every ring, formats the records and writes them out in large batches.
+ * When a ring is full the record is dropped and counted instead of
+ * making the worker wait.
+ *
+ * Lines are in the Common Log Format, followed by the time the request
+ * spent in each stage in microseconds:
+ *   127.0.0.1 - - [17/Oct/2026:10:00:00 +0000] "GET /index.html HTTP/1.1" 200 1024
+ *   queue_us=12 parse_us=1 resolve_us=8 handle_us=5 write_us=20 total_us=33
+ * (on one line). Lines of different threads may be out of order by up to
+ * one batch. access_log_reopen, e.g. from a SIGHUP handler, makes the
+ * writer reopen the file after it has been renamed for rotation.
+ */
+
+#define ACCESS_LOG_RING_SIZE 1024       //records per thread, a power of two
+#define ACCESS_LOG_METHOD_MAX 16
+#define ACCESS_LOG_TARGET_MAX 256       //longer targets are cut short
+#define ACCESS_LOG_INTERVAL_MS 50       //how often the writer looks for records
+#define ACCESS_LOG_BATCH_SIZE (256 * 1024)
+
+typedef struct access_record_st {
+    int64_t time_s;                 //wall clock second the request finished
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } peer;                         //client address, sa_family 0 if unknown
+    int status;                     //0 if no response was sent
+    int major_version;              //as the request line gave it
+    int minor_version;
+    uint64_t bytes;                 //bytes written, head included
+    uint64_t stage_ns[METRIC_STAGE_COUNT];
+    char method[ACCESS_LOG_METHOD_MAX];     //NUL terminated, empty if unparsed
+    char target[ACCESS_LOG_TARGET_MAX];
+} access_record;
+
+/**
+ * access_log_open opens path for appending and starts the writer thread.
+ * Returns 0, or -1 if the file can't be opened.
+ */
+int access_log_open(const char* path);
+
+/**
+ * access_log_enabled returns 1 once access_log_open succeeded.
+ */
+int access_log_enabled(void);
+
+/**
+ * access_log_reserve returns the next free record of the calling
+ * thread's ring, to be filled and handed over with access_log_commit.
+ * Returns NULL if logging is off, or if the ring is full, in which case
+ * the record counts as dropped.
+ */
+access_record* access_log_reserve(void);
+
+/**
+ * access_log_commit publishes the record last reserved by this thread.
+ */
+void access_log_commit(access_record* rec);
+
+/**
+ * access_log_reopen asks the writer to reopen the file before its next
+ * batch. Async-signal-safe.
+ */
+void access_log_reopen(void);
+
+/**
+ * access_log_close writes out what is left, stops the writer and closes
+ * the file. Call it once no thread logs anymore.
+ */
+void access_log_close(void);
+
+/**
+ * access_log_dropped returns how many records were dropped on a full ring.
+ */
+unsigned long access_log_dropped(void);
+
+/**
+ * access_log_written returns how many lines were written.
+ */
+unsigned long access_log_written(void);
+
+#endif
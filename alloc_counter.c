@@ -0,0 +1,66 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include "alloc_counter.h"
+
+static atomic_ulong allocations;
+
+unsigned long alloc_counter_total(void) {
+    return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+#ifdef __GLIBC__
+
+// glibc's own entry points; defining malloc here overrides it for every
+// library in the process, and these still reach the real allocator
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* p);
+
+static inline void count(void) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+}
+
+void* malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    count();
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    count();
+    return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+    __libc_free(p);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    count();
+    void* p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+/**
+ * alloc_counter.h
+ *
+ * Counts heap allocations made anywhere in the process, libraries
+ * included, by wrapping malloc, calloc, realloc and the aligned variants
+ * around the glibc allocator. The total should stop moving once the
+ * server is warm: a steady stream of requests for cached files is served
+ * without allocating. With another C library the wrappers are left out
+ * and the count stays 0.
+ */
+
+/**
+ * alloc_counter_total returns the number of allocations so far.
+ */
+unsigned long alloc_counter_total(void);
+
+#endif
@@ -0,0 +1,75 @@
+//NOAM
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "arena.h"
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static atomic_size_t peak_used;
+
+static void destroy_arena(void* p) {
+    arena* a = (arena*)p;
+    free(a->base);
+    free(a);
+}
+
+static void create_key(void) {
+    pthread_key_create(&arena_key, destroy_arena);
+}
+
+arena* arena_for_thread(void) {
+    pthread_once(&key_once, create_key);
+    arena* a = (arena*)pthread_getspecific(arena_key);
+    if (a) {
+        return a;
+    }
+
+    a = (arena*)malloc(sizeof(arena));
+    if (!a) {
+        return NULL;
+    }
+    a->used = 0;
+    a->peak = 0;
+    a->base = (char*)aligned_alloc(ARENA_ALIGN, ARENA_SIZE);
+    if (!a->base) {
+        free(a);
+        return NULL;
+    }
+    pthread_setspecific(arena_key, a);
+    return a;
+}
+
+void* arena_alloc(arena* a, size_t size) {
+    if (!a) {
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > ARENA_SIZE - a->used) {
+        return NULL;
+    }
+    void* p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+void arena_reset(arena* a) {
+    if (!a) {
+        return;
+    }
+    // Only a new high for this thread touches the shared value
+    if (a->used > a->peak) {
+        a->peak = a->used;
+        size_t seen = atomic_load_explicit(&peak_used, memory_order_relaxed);
+        while (seen < a->peak &&
+               !atomic_compare_exchange_weak_explicit(&peak_used, &seen, a->peak,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+    a->used = 0;
+}
+
+size_t arena_peak(void) {
+    return atomic_load_explicit(&peak_used, memory_order_relaxed);
+}
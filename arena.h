@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * arena.h
+ *
+ * Per-thread scratch memory for one request. Allocating bumps a pointer
+ * and nothing is freed on its own: the worker resets its arena once the
+ * request is done, and the next request reuses the same memory. Paths,
+ * cache keys and streaming buffers live here instead of in large stack
+ * frames, and serving a request from the caches does not touch the heap.
+ */
+
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_st {
+    size_t used;                    //bytes handed out since the last reset
+    size_t peak;                    //most bytes in use at once, for sizing ARENA_SIZE
+    char* base;                     //ARENA_SIZE bytes
+} arena;
+
+/**
+ * arena_for_thread returns the calling thread's arena, creating it on the
+ * first call; it is freed when the thread exits. Returns NULL if it can't
+ * be allocated.
+ */
+arena* arena_for_thread(void);
+
+/**
+ * arena_alloc returns size bytes aligned to ARENA_ALIGN, valid until the
+ * next arena_reset. Returns NULL if a is NULL or out of room.
+ */
+void* arena_alloc(arena* a, size_t size);
+
+/**
+ * arena_reset releases everything allocated from a at once.
+ */
+void arena_reset(arena* a);
+
+/**
+ * arena_peak returns the most bytes any arena had in use at once.
+ */
+size_t arena_peak(void);
+
+#endif
@@ -0,0 +1,206 @@
+//NOAM
+
+/**
+ * bench_io.c
+ *
+ * Cost of sending a file response over a local TCP connection, the way
+ * the server does it with --io=sync and with --io=uring. The sync path
+ * writes the head with writev() and the body with sendfile(), polling
+ * when the socket is full. The uring path hands head and body to
+ * uring_send_file(), one linked chain per round of registered buffers.
+ *
+ * A second thread drains the connection. Each variant is timed for a
+ * small file and a large one.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -I. -o bench_io bench/bench_io.c uring.c -lpthread
+ *   ./bench_io [responses] [large-size]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+#define DEFAULT_RESPONSES 20000
+#define DEFAULT_LARGE_SIZE (1024 * 1024)
+#define SMALL_SIZE 4096
+#define DRAIN_SIZE (256 * 1024)
+
+static const char head[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: webserver/1.0\r\n"
+    "Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: keep-alive\r\n\r\n";
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* drain(void* arg) {
+    int fd = *(int*)arg;
+    char* buf = (char*)malloc(DRAIN_SIZE);
+    while (buf && read(fd, buf, DRAIN_SIZE) > 0) {
+    }
+    free(buf);
+    return NULL;
+}
+
+// A connected loopback pair; the sending end is non-blocking like the server's
+static int connect_pair(int* sender, int* receiver) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 1) < 0 || getsockname(listener, (struct sockaddr*)&addr, &len) < 0) {
+        perror("listen");
+        return -1;
+    }
+    *receiver = socket(AF_INET, SOCK_STREAM, 0);
+    if (*receiver < 0 || connect(*receiver, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    *sender = accept(listener, NULL, NULL);
+    close(listener);
+    if (*sender < 0) {
+        perror("accept");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(*sender, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(*sender, F_SETFL, fcntl(*sender, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static int wait_writable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+}
+
+// writev() for the head, then sendfile() until the body is out
+static int send_sync(int sock, int file_fd, size_t size) {
+    struct iovec iov = { (void*)head, sizeof(head) - 1 };
+    while (iov.iov_len > 0) {
+        ssize_t n = writev(sock, &iov, 1);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) return -1;
+            if (wait_writable(sock) < 0) return -1;
+            continue;
+        }
+        iov.iov_base = (char*)iov.iov_base + n;
+        iov.iov_len -= (size_t)n;
+    }
+    off_t offset = 0;
+    while ((size_t)offset < size) {
+        ssize_t n = sendfile(sock, file_fd, &offset, size - (size_t)offset);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) return -1;
+            if (wait_writable(sock) < 0) return -1;
+        }
+        else if (n == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_uring(uring* u, int sock, int file_fd, size_t size) {
+    struct iovec iov = { (void*)head, sizeof(head) - 1 };
+    return uring_send_file(u, sock, &iov, 1, file_fd, 0, size, 0, 0) == (ssize_t)size ? 0 : -1;
+}
+
+static int make_file(size_t size) {
+    char name[] = "/tmp/bench_io_XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(name);
+    char block[4096];
+    memset(block, 'x', sizeof(block));
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        size_t len = size - done < sizeof(block) ? size - done : sizeof(block);
+        if (write(fd, block, len) != (ssize_t)len) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void run(const char* name, uring* u, int file_fd, size_t size, long responses) {
+    int sender, receiver;
+    if (connect_pair(&sender, &receiver) < 0) {
+        exit(1);
+    }
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain, &receiver);
+
+    double start = now_seconds();
+    for (long i = 0; i < responses; i++) {
+        int rc = u ? send_uring(u, sender, file_fd, size) : send_sync(sender, file_fd, size);
+        if (rc < 0) {
+            perror(name);
+            exit(1);
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    close(sender);
+    pthread_join(drainer, NULL);
+    close(receiver);
+    printf("%-8s %8zu bytes: %8.2f us/response  %8.1f MB/s\n", name, size,
+           elapsed * 1e6 / responses, responses * (double)size / elapsed / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    long responses = argc > 1 ? atol(argv[1]) : DEFAULT_RESPONSES;
+    size_t large = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_LARGE_SIZE;
+    if (responses <= 0 || large == 0) {
+        fprintf(stderr, "usage: %s [responses] [large-size]\n", argv[0]);
+        return 1;
+    }
+
+    uring* u = uring_for_thread();
+    if (!u) {
+        printf("io_uring is not available, timing sendfile() only\n");
+    }
+    size_t sizes[2] = { SMALL_SIZE, large };
+    for (int i = 0; i < 2; i++) {
+        int file_fd = make_file(sizes[i]);
+        if (file_fd < 0) {
+            return 1;
+        }
+        // Fewer rounds for the large file, so both take similar time
+        long n = i == 0 ? responses : responses / 50 + 1;
+        run("sendfile", NULL, file_fd, sizes[i], n);
+        if (u) {
+            run("uring", u, file_fd, sizes[i], n);
+        }
+        close(file_fd);
+    }
+    return 0;
+}
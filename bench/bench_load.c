@@ -0,0 +1,467 @@
+//NOAM
+
+/**
+ * bench_load.c
+ *
+ * HTTP load generator for comparing the server against a baseline on
+ * loopback. Every connection is driven by a thread of its own that sends
+ * one request at a time and reads the whole response (Content-Length,
+ * chunked or close-delimited) before the next one.
+ *
+ *   closed loop (default) - the next request is sent as soon as the
+ *                           previous response is complete
+ *   open loop (--rate)    - requests are due on a fixed schedule, and a
+ *                           request's latency is counted from when it was
+ *                           due, so a server that falls behind is not
+ *                           flattered by the client waiting for it
+ *
+ * Paths are picked at random by weight, which is how a mix of file sizes
+ * and directory listings is described.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -I. -o bench_load bench/bench_load.c -lpthread
+ *   ./bench_load --connections=32 --duration=10 --path=/small.txt:80 --path=/big.bin:20 8080
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10
+#define MAX_TARGETS 32
+#define READ_BUFFER_SIZE 65536
+#define LINE_SIZE 1024
+
+typedef struct target_st {
+    const char* path;
+    int weight;
+} target;
+
+typedef struct reader_st {
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[READ_BUFFER_SIZE];
+} reader;
+
+typedef struct worker_st {
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t* samples;              //latency of every completed request, ns
+    size_t count;
+    size_t capacity;
+    long errors;                    //failed connects, resets, malformed responses
+    long non_2xx;
+    long connects;
+    unsigned long bytes;            //response bytes, head included
+    reader rd;
+} worker;
+
+static struct sockaddr_in server_addr;
+static target targets[MAX_TARGETS];
+static int num_targets = 0;
+static int total_weight = 0;
+static int keep_alive = 1;
+static double rate = 0;             //requests per second over all connections, 0 for closed loop
+static uint64_t start_ns;
+static uint64_t deadline_ns;
+static int num_connections = DEFAULT_CONNECTIONS;
+
+static const char* usage =
+    "Usage: bench_load [options] <port>\n"
+    "  --host=<ipv4>            server address (default 127.0.0.1)\n"
+    "  --connections=<n>        concurrent connections, one thread each (default 16)\n"
+    "  --duration=<sec>         how long to run (default 10)\n"
+    "  --rate=<req/s>           open loop at this total rate instead of closed loop\n"
+    "  --no-keepalive           a new connection for every request\n"
+    "  --path=<path>[:<weight>] request path and its share of requests, repeatable (default /)\n";
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when) {
+    struct timespec ts = { (time_t)(when / 1000000000ull), (long)(when % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Reads more bytes behind the unread ones; 0 on EOF, -1 on error
+static ssize_t reader_fill(reader* rd) {
+    if (rd->pos == rd->len) {
+        rd->pos = rd->len = 0;
+    }
+    else if (rd->len == sizeof(rd->buf)) {
+        memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+        rd->len -= rd->pos;
+        rd->pos = 0;
+    }
+    ssize_t n;
+    do {
+        n = read(rd->fd, rd->buf + rd->len, sizeof(rd->buf) - rd->len);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        rd->len += (size_t)n;
+    }
+    return n;
+}
+
+// One line without its CRLF, cut to fit line
+static int reader_line(reader* rd, char* line, size_t size) {
+    while (1) {
+        char* nl = memchr(rd->buf + rd->pos, '\n', rd->len - rd->pos);
+        if (nl) {
+            size_t n = (size_t)(nl - (rd->buf + rd->pos));
+            size_t keep = n > 0 && nl[-1] == '\r' ? n - 1 : n;
+            if (keep >= size) keep = size - 1;
+            memcpy(line, rd->buf + rd->pos, keep);
+            line[keep] = '\0';
+            rd->pos += n + 1;
+            return 0;
+        }
+        if (rd->pos == 0 && rd->len == sizeof(rd->buf)) {
+            return -1;      // longer than the whole buffer
+        }
+        if (reader_fill(rd) <= 0) {
+            return -1;
+        }
+    }
+}
+
+// Discards n bytes; -1 if the connection ended first
+static int reader_skip(reader* rd, unsigned long n) {
+    while (n > 0) {
+        if (rd->pos == rd->len && reader_fill(rd) <= 0) {
+            return -1;
+        }
+        size_t take = rd->len - rd->pos < n ? rd->len - rd->pos : n;
+        rd->pos += take;
+        n -= take;
+    }
+    return 0;
+}
+
+// Reads one response; *bytes gets its size and *closing whether the server ends the connection
+static int read_response(reader* rd, int* status, unsigned long* bytes, int* closing) {
+    char line[LINE_SIZE];
+    if (reader_line(rd, line, sizeof(line)) < 0 || sscanf(line, "HTTP/1.%*d %d", status) != 1) {
+        return -1;
+    }
+    *bytes = strlen(line) + 2;
+    *closing = strncmp(line, "HTTP/1.0", 8) == 0;
+
+    long content_length = -1;
+    int chunked = 0;
+    while (1) {
+        if (reader_line(rd, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        *bytes += strlen(line) + 2;
+        if (line[0] == '\0') {
+            break;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = atol(line + 15);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked")) {
+            chunked = 1;
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            *closing = strstr(line, "close") != NULL;
+        }
+    }
+
+    if (*status == 304 || *status / 100 == 1) {
+        return 0;
+    }
+    if (chunked) {
+        while (1) {
+            if (reader_line(rd, line, sizeof(line)) < 0) {
+                return -1;
+            }
+            unsigned long size = strtoul(line, NULL, 16);
+            if (reader_skip(rd, size + 2) < 0) {
+                return -1;
+            }
+            *bytes += strlen(line) + 2 + size + 2;
+            if (size == 0) {
+                return 0;
+            }
+        }
+    }
+    if (content_length >= 0) {
+        *bytes += (unsigned long)content_length;
+        return reader_skip(rd, (unsigned long)content_length);
+    }
+
+    // Close-delimited: the body is whatever arrives until EOF
+    *closing = 1;
+    *bytes += rd->len - rd->pos;
+    rd->pos = rd->len;
+    ssize_t n;
+    while ((n = reader_fill(rd)) > 0) {
+        *bytes += (unsigned long)n;
+        rd->pos = rd->len;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+static int open_connection(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static const char* pick_path(worker* w) {
+    int r = rand_r(&w->seed) % total_weight;
+    for (int i = 0; i < num_targets; i++) {
+        if ((r -= targets[i].weight) < 0) {
+            return targets[i].path;
+        }
+    }
+    return targets[0].path;
+}
+
+static void record(worker* w, uint64_t ns) {
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? w->capacity * 2 : 65536;
+        uint64_t* grown = (uint64_t*)realloc(w->samples, capacity * sizeof(uint64_t));
+        if (!grown) {
+            return;
+        }
+        w->samples = grown;
+        w->capacity = capacity;
+    }
+    w->samples[w->count++] = ns;
+}
+
+static void* run_worker(void* arg) {
+    worker* w = (worker*)arg;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * num_connections / rate) : 0;
+    // Spread the connections' schedules over one interval
+    uint64_t due = start_ns + (interval ? (uint64_t)rand_r(&w->seed) % interval : 0);
+    int fd = -1;
+
+    while (1) {
+        uint64_t sent_at;
+        if (interval) {
+            if (due >= deadline_ns) break;
+            sleep_until(due);
+            sent_at = due;
+            due += interval;
+        }
+        else {
+            sent_at = now_ns();
+            if (sent_at >= deadline_ns) break;
+        }
+
+        if (fd < 0) {
+            if ((fd = open_connection()) < 0) {
+                w->errors++;
+                continue;
+            }
+            w->connects++;
+            w->rd.fd = fd;
+            w->rd.pos = w->rd.len = 0;
+        }
+
+        char request[LINE_SIZE];
+        int len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                           pick_path(w), keep_alive ? "keep-alive" : "close");
+        int status;
+        unsigned long bytes;
+        int closing;
+        if (write(fd, request, (size_t)len) != len || read_response(&w->rd, &status, &bytes, &closing) < 0) {
+            w->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        record(w, now_ns() - sent_at);
+        w->bytes += bytes;
+        if (status / 100 != 2) {
+            w->non_2xx++;
+        }
+        if (closing || !keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t* sorted, size_t count, double q) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(q * (double)count + 0.999999);
+    if (rank == 0) rank = 1;
+    return sorted[rank - 1] / 1e3;
+}
+
+static int add_target(char* arg) {
+    if (num_targets == MAX_TARGETS || arg[0] != '/') {
+        return -1;
+    }
+    int weight = 1;
+    char* colon = strrchr(arg, ':');
+    if (colon) {
+        *colon = '\0';
+        weight = atoi(colon + 1);
+    }
+    if (weight <= 0) {
+        return -1;
+    }
+    targets[num_targets].path = arg;
+    targets[num_targets].weight = weight;
+    num_targets++;
+    total_weight += weight;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    int duration = DEFAULT_DURATION;
+
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"no-keepalive", no_argument, NULL, 'n'},
+        {"path", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'c':
+            num_connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            keep_alive = 0;
+            break;
+        case 'p':
+            if (add_target(optarg) < 0) {
+                fprintf(stderr, "bad --path %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 1 || num_connections <= 0 || duration <= 0 || rate < 0) {
+        fprintf(stderr, "%s", usage);
+        return EXIT_FAILURE;
+    }
+    if (num_targets == 0) {
+        static char root[] = "/";
+        add_target(root);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t)atoi(argv[optind]));
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad --host %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    worker* workers = (worker*)calloc((size_t)num_connections, sizeof(worker));
+    if (!workers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    start_ns = now_ns();
+    deadline_ns = start_ns + (uint64_t)duration * 1000000000ull;
+    for (int i = 0; i < num_connections; i++) {
+        workers[i].seed = (unsigned int)i * 2654435761u + 1;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t count = 0;
+    long errors = 0, non_2xx = 0, connects = 0;
+    unsigned long bytes = 0;
+    for (int i = 0; i < num_connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        count += workers[i].count;
+        errors += workers[i].errors;
+        non_2xx += workers[i].non_2xx;
+        connects += workers[i].connects;
+        bytes += workers[i].bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    uint64_t* all = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!all) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t n = 0;
+    for (int i = 0; i < num_connections; i++) {
+        memcpy(all + n, workers[i].samples, workers[i].count * sizeof(uint64_t));
+        n += workers[i].count;
+        free(workers[i].samples);
+    }
+    qsort(all, count, sizeof(uint64_t), compare_samples);
+
+    printf("%s loop, %d connections, keep-alive %s, %d s\n",
+           rate > 0 ? "open" : "closed", num_connections, keep_alive ? "on" : "off", duration);
+    printf("%10zu requests %12.0f req/s %10.1f MB/s %8ld connects %6ld errors %6ld non-2xx\n",
+           count, count / elapsed, bytes / elapsed / (1024 * 1024), connects, errors, non_2xx);
+    printf("latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           percentile_us(all, count, 0.5), percentile_us(all, count, 0.99),
+           percentile_us(all, count, 0.999), percentile_us(all, count, 1.0));
+
+    free(all);
+    free(workers);
+    return errors > 0 ? EXIT_FAILURE : 0;
+}
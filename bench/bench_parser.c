@@ -0,0 +1,89 @@
+//NOAM
+
+/**
+ * bench_parser.c
+ *
+ * Single-core throughput of the incremental request parser on a typical
+ * browser request head. The head is parsed once in one piece and once fed
+ * in small segments, the way it arrives over a slow connection.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -I. -o bench_parser bench/bench_parser.c http_parser.c
+ *   ./bench_parser [iterations] [segment-size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http_parser.h"
+
+#define DEFAULT_ITERATIONS 2000000
+#define DEFAULT_SEGMENT_SIZE 16
+
+static const char request_head[] =
+    "GET /static/css/site.css?v=42 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=4f2a9c1e0b7d; theme=dark\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "If-Modified-Since: Tue, 01 Oct 2024 10:00:00 GMT\r\n"
+    "\r\n";
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// segment == 0 parses the whole head in one call
+static void run(long iterations, size_t segment) {
+    size_t len = sizeof(request_head) - 1;
+    http_parser p;
+    long headers = 0;
+
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        http_parser_init(&p, NULL);
+        http_parse_result rc = HTTP_PARSE_INCOMPLETE;
+        if (segment == 0) {
+            rc = http_parser_execute(&p, request_head, len);
+        }
+        else {
+            for (size_t have = segment; rc == HTTP_PARSE_INCOMPLETE; have += segment) {
+                rc = http_parser_execute(&p, request_head, have < len ? have : len);
+            }
+        }
+        if (rc != HTTP_PARSE_DONE) {
+            fprintf(stderr, "parse failed with status %d\n", p.error_status);
+            exit(EXIT_FAILURE);
+        }
+        headers += p.num_headers;   // keep the result alive
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("%-22s %10.0f requests/s %8.1f MB/s (%ld headers)\n",
+           segment ? "segmented" : "whole head",
+           iterations / elapsed, iterations * (double)len / elapsed / 1e6, headers);
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    size_t segment = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_SEGMENT_SIZE;
+    if (iterations <= 0 || segment == 0) {
+        fprintf(stderr, "Usage: bench_parser [iterations] [segment-size]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu byte request head, %ld iterations, %zu byte segments\n",
+           sizeof(request_head) - 1, iterations, segment);
+    run(iterations, 0);
+    run(iterations, segment);
+    return 0;
+}
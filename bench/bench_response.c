@@ -0,0 +1,249 @@
+//NOAM
+
+/**
+ * bench_response.c
+ *
+ * Per-response CPU cost of assembling and sending a small 200 response.
+ * The old way rendered the head with snprintf, picked the extra headers
+ * out with strstr and glued them on with strncat, then wrote head and
+ * body with two write() calls. The new way appends to a header_builder
+ * and sends head and body with one writev().
+ *
+ * Each variant is timed building heads only, and building plus sending
+ * them over a local socket that a second thread drains.
+ *
+ * The 404 path is timed too: formatting the date and the whole page per
+ * request, against a prebuilt page sent around the shared Date string.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -I. -o bench_response bench/bench_response.c header_builder.c http_date.c -lpthread
+ *   ./bench_response [responses] [body-size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "header_builder.h"
+#include "http_date.h"
+
+#define DEFAULT_RESPONSES 1000000
+#define DEFAULT_BODY_SIZE 512
+#define BUFFER_SIZE 4096
+
+static const char* date = "Sat, 17 Oct 2026 10:00:00 GMT";
+static const char* extra_header =
+    "Content-Type: text/html\r\n"
+    "Last-Modified: Tue, 01 Oct 2024 10:00:00 GMT\r\n"
+    "ETag: \"ce8013-528-18df72aebebaa83b\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Vary: Accept-Encoding\r\n";
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copying one line out of a longer string is what the old code did, and
+// what is being measured; GCC takes the length bound for a mistake
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstringop-truncation"
+static void copy_header(char* header, const char* name) {
+    const char* line = strstr(extra_header, name);
+    if (line) {
+        strncat(header, line, strcspn(line, "\r\n"));
+        strncat(header, "\r\n", BUFFER_SIZE - strlen(header) - 1);
+    }
+}
+#pragma GCC diagnostic pop
+
+// The head the way send_headers used to build it
+static size_t build_strncat(char* header, size_t body_size) {
+    snprintf(header, BUFFER_SIZE,
+        "HTTP/1.1 200 OK\r\n"
+        "Server: webserver/1.0\r\n"
+        "Date: %s\r\n", date);
+    copy_header(header, "Location:");
+    copy_header(header, "Content-Type:");
+    copy_header(header, "Content-Encoding:");
+    char content_length[64];
+    snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", body_size);
+    strncat(header, content_length, BUFFER_SIZE - strlen(header) - 1);
+    copy_header(header, "Last-Modified:");
+    copy_header(header, "ETag:");
+    copy_header(header, "Accept-Ranges:");
+    copy_header(header, "Vary:");
+    strncat(header, "Connection: keep-alive\r\n\r\n", BUFFER_SIZE - strlen(header) - 1);
+    return strlen(header);
+}
+
+static void build_builder(header_builder* hb, size_t body_size) {
+    header_builder_reset(hb);
+    header_builder_status_line(hb, 1, 200, "OK");
+    header_builder_add(hb, "Server", "webserver/1.0");
+    header_builder_add(hb, "Date", date);
+    header_builder_add(hb, "Content-Type", "text/html");
+    header_builder_add_number(hb, "Content-Length", (long long)body_size);
+    header_builder_add(hb, "Last-Modified", "Tue, 01 Oct 2024 10:00:00 GMT");
+    header_builder_add(hb, "ETag", "\"ce8013-528-18df72aebebaa83b\"");
+    header_builder_add(hb, "Accept-Ranges", "bytes");
+    header_builder_add(hb, "Vary", "Accept-Encoding");
+    header_builder_add(hb, "Connection", "keep-alive");
+    header_builder_end(hb);
+}
+
+static void* drain(void* arg) {
+    int fd = *(int*)arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+static void report(const char* name, long responses, double elapsed, long syscalls) {
+    printf("%-22s %8.1f ns/response %12.0f responses/s %5.1f syscalls/response\n",
+           name, elapsed / responses * 1e9, responses / elapsed, (double)syscalls / responses);
+}
+
+static void run(int use_builder, int send, long responses, const char* body, size_t body_size) {
+    int fds[2] = { -1, -1 };
+    pthread_t reader;
+    if (send) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&reader, NULL, drain, &fds[1]);
+    }
+
+    char header[BUFFER_SIZE];
+    header_builder hb;
+    long syscalls = 0;
+    size_t sink = 0;
+
+    double start = now_seconds();
+    for (long i = 0; i < responses; i++) {
+        if (use_builder) {
+            build_builder(&hb, body_size);
+            sink += hb.len;
+            if (send) {
+                struct iovec iov[2] = { { hb.data, hb.len }, { (void*)body, body_size } };
+                if (writev(fds[0], iov, 2) < 0) {
+                    perror("writev");
+                    exit(EXIT_FAILURE);
+                }
+                syscalls++;
+            }
+        }
+        else {
+            size_t len = build_strncat(header, body_size);
+            sink += len;
+            if (send) {
+                if (write(fds[0], header, len) < 0 || write(fds[0], body, body_size) < 0) {
+                    perror("write");
+                    exit(EXIT_FAILURE);
+                }
+                syscalls += 2;
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    if (send) {
+        close(fds[0]);
+        pthread_join(reader, NULL);
+        close(fds[1]);
+    }
+    if (sink == 0) {
+        puts("");   // keep the heads alive
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s", use_builder ? "builder" : "strncat", send ? "+send" : "build");
+    report(name, responses, elapsed, syscalls);
+}
+
+static const char* not_found_body = "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H4>404 Not Found</H4>\nFile not found.\n</BODY></HTML>";
+
+// A 404 rendered from scratch, or prebuilt with the Date spliced in
+static void run_not_found(int use_canned, long responses) {
+    int fds[2];
+    pthread_t reader;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&reader, NULL, drain, &fds[1]);
+
+    char canned[BUFFER_SIZE];
+    int canned_len = snprintf(canned, sizeof(canned),
+        "HTTP/1.1 404 Not Found\r\nServer: webserver/1.0\r\nDate: %*s\r\n"
+        "Content-Type: text/html\r\nContent-Length: %zu\r\nConnection: keep-alive\r\n\r\n%s",
+        HTTP_DATE_LEN, "", strlen(not_found_body), not_found_body);
+    int date_offset = (int)(strstr(canned, "Date: ") - canned) + 6;
+
+    double start = now_seconds();
+    for (long i = 0; i < responses; i++) {
+        ssize_t n;
+        if (use_canned) {
+            struct iovec iov[3] = {
+                { canned, (size_t)date_offset },
+                { (void*)http_date_now(), HTTP_DATE_LEN },
+                { canned + date_offset + HTTP_DATE_LEN, (size_t)(canned_len - date_offset - HTTP_DATE_LEN) }
+            };
+            n = writev(fds[0], iov, 3);
+        }
+        else {
+            char timebuf[128];
+            time_t now = time(NULL);
+            strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+            char response[BUFFER_SIZE];
+            int len = snprintf(response, sizeof(response),
+                "HTTP/1.1 404 Not Found\r\nServer: webserver/1.0\r\nDate: %s\r\n"
+                "Content-Type: text/html\r\nContent-Length: %zu\r\nConnection: keep-alive\r\n\r\n%s",
+                timebuf, strlen(not_found_body), not_found_body);
+            n = write(fds[0], response, (size_t)len);
+        }
+        if (n < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    close(fds[0]);
+    pthread_join(reader, NULL);
+    close(fds[1]);
+    report(use_canned ? "canned 404" : "formatted 404", responses, elapsed, responses);
+}
+
+int main(int argc, char* argv[]) {
+    long responses = argc > 1 ? atol(argv[1]) : DEFAULT_RESPONSES;
+    size_t body_size = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_BODY_SIZE;
+    if (responses <= 0) {
+        fprintf(stderr, "Usage: bench_response [responses] [body-size]\n");
+        return EXIT_FAILURE;
+    }
+
+    char* body = (char*)malloc(body_size > 0 ? body_size : 1);
+    if (!body) {
+        return EXIT_FAILURE;
+    }
+    memset(body, 'x', body_size);
+
+    printf("%ld responses, %zu byte body\n", responses, body_size);
+    run(0, 0, responses, body, body_size);
+    run(1, 0, responses, body, body_size);
+    run(0, 1, responses, body, body_size);
+    run(1, 1, responses, body, body_size);
+    run_not_found(0, responses);
+    run_not_found(1, responses);
+
+    free(body);
+    return 0;
+}
@@ -0,0 +1,250 @@
+//NOAM
+
+/**
+ * bench_threadpool.c
+ *
+ * Throughput of the threadpool queue backends (mutex, ring, steal).
+ * Two workloads are timed for each backend:
+ *   external - one producer thread dispatches every job, like the reactor
+ *   spawn    - the producer dispatches parents that each dispatch children
+ *              from inside the pool, where work stealing keeps them local
+ * Then the cost of a single job is measured, one job at a time on an idle
+ * pool: how long dispatch() takes to return, and how long until do_work
+ * starts running the job on a worker (the wakeup latency). Last, short
+ * jobs are timed behind a standing backlog of long ones on the mutex
+ * queue, first with a single FIFO and then with the long jobs on a lane
+ * of their own (weights 8:1), as --pool-lanes does for large files.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -I. -o bench_threadpool bench/bench_threadpool.c threadpool.c -lpthread
+ *   ./bench_threadpool [threads] [queue-size] [jobs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include "threadpool.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_QUEUE_SIZE 200
+#define DEFAULT_JOBS 1000000
+#define CHILDREN_PER_PARENT 8
+#define LATENCY_SAMPLES 20000
+#define MIXED_SAMPLES 2000
+#define LONG_JOB_NS 20000
+
+static threadpool* pool;
+static atomic_long completed;
+static atomic_long in_flight;        //jobs dispatched or promised but not yet run
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A little arithmetic so a job is not free
+static int leaf_job(void* arg) {
+    unsigned long x = (unsigned long)arg;
+    for (int i = 0; i < 64; i++) {
+        x = x * 6364136223846793005ul + 1442695040888963407ul;
+    }
+    if (x == 0) {
+        puts("");   // keep the loop alive
+    }
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&in_flight, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int parent_job(void* arg) {
+    for (long i = 0; i < CHILDREN_PER_PARENT; i++) {
+        dispatch(pool, leaf_job, (void*)((long)arg + i));
+    }
+    return leaf_job(arg);
+}
+
+static const char* kind_name(threadpool_queue_kind kind) {
+    switch (kind) {
+    case THREADPOOL_QUEUE_RING: return "ring";
+    case THREADPOOL_QUEUE_STEAL: return "steal";
+    default: return "mutex";
+    }
+}
+
+static void run(threadpool_queue_kind kind, int spawn, int threads, int queue_size, long jobs) {
+    threadpool_config config;
+    threadpool_config_init(&config, threads, queue_size);
+    config.queue_kind = kind;
+
+    pool = create_threadpool_with_config(&config);
+    if (!pool) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&completed, 0);
+    atomic_store(&in_flight, 0);
+
+    double start = now_seconds();
+    if (spawn) {
+        // A worker blocked on a full queue can't drain it, so never let
+        // parents and their children outgrow the queue
+        long parents = jobs / (CHILDREN_PER_PARENT + 1);
+        for (long i = 0; i < parents; i++) {
+            while (atomic_load(&in_flight) + CHILDREN_PER_PARENT + 1 > queue_size) {
+                sched_yield();
+            }
+            atomic_fetch_add(&in_flight, CHILDREN_PER_PARENT + 1);
+            dispatch(pool, parent_job, (void*)i);
+        }
+    }
+    else {
+        for (long i = 0; i < jobs; i++) {
+            atomic_fetch_add(&in_flight, 1);
+            dispatch(pool, leaf_job, (void*)i);
+        }
+    }
+    // Children dispatched once destroy_threadpool stopped accepting are dropped
+    while (atomic_load(&in_flight) > 0) {
+        sched_yield();
+    }
+    destroy_threadpool(pool);
+    double elapsed = now_seconds() - start;
+
+    long done = atomic_load(&completed);
+    printf("%-6s %-9s %10ld jobs %8.3f s %12.0f jobs/s\n",
+           kind_name(kind), spawn ? "spawn" : "external", done, elapsed, done / elapsed);
+}
+
+static _Atomic uint64_t started_at;
+
+static int timed_job(void* arg) {
+    (void)arg;
+    atomic_store(&started_at, now_ns());
+    return 0;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_latency(threadpool_queue_kind kind, int threads, int queue_size) {
+    threadpool_config config;
+    threadpool_config_init(&config, threads, queue_size);
+    config.queue_kind = kind;
+
+    pool = create_threadpool_with_config(&config);
+    if (!pool) {
+        exit(EXIT_FAILURE);
+    }
+
+    static uint64_t call[LATENCY_SAMPLES];
+    static uint64_t pickup[LATENCY_SAMPLES];
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        atomic_store(&started_at, 0);
+        uint64_t start = now_ns();
+        dispatch(pool, timed_job, NULL);
+        call[i] = now_ns() - start;
+        uint64_t ran;
+        while ((ran = atomic_load(&started_at)) == 0) {
+            sched_yield();
+        }
+        pickup[i] = ran - start;
+    }
+    destroy_threadpool(pool);
+
+    qsort(call, LATENCY_SAMPLES, sizeof(uint64_t), compare_samples);
+    qsort(pickup, LATENCY_SAMPLES, sizeof(uint64_t), compare_samples);
+    printf("%-6s dispatch() p50 %6.2f us p99 %7.2f us | to do_work p50 %6.2f us p99 %7.2f us p99.9 %7.2f us\n",
+           kind_name(kind), call[LATENCY_SAMPLES / 2] / 1e3, call[LATENCY_SAMPLES * 99 / 100] / 1e3,
+           pickup[LATENCY_SAMPLES / 2] / 1e3, pickup[LATENCY_SAMPLES * 99 / 100] / 1e3,
+           pickup[LATENCY_SAMPLES * 999 / 1000] / 1e3);
+}
+
+static atomic_long long_in_flight;
+
+// Stands in for a large response: busy for LONG_JOB_NS
+static int long_job(void* arg) {
+    (void)arg;
+    uint64_t until = now_ns() + LONG_JOB_NS;
+    while (now_ns() < until) {
+    }
+    atomic_fetch_sub(&long_in_flight, 1);
+    return 0;
+}
+
+static void run_mixed(int lanes, int threads, int queue_size) {
+    threadpool_config config;
+    threadpool_config_init(&config, threads, queue_size);
+    int long_lane = 0;
+    if (lanes) {
+        config.num_lanes = 2;
+        config.lanes[0] = (threadpool_lane){ 8, 0 };
+        config.lanes[1] = (threadpool_lane){ 1, queue_size / 2 };
+        long_lane = 1;
+    }
+
+    pool = create_threadpool_with_config(&config);
+    if (!pool) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&long_in_flight, 0);
+
+    static uint64_t pickup[MIXED_SAMPLES];
+    for (int i = 0; i < MIXED_SAMPLES; i++) {
+        // Keep half the queue full of long jobs
+        while (atomic_load(&long_in_flight) < queue_size / 2) {
+            atomic_fetch_add(&long_in_flight, 1);
+            dispatch_lane(pool, long_lane, long_job, NULL);
+        }
+        atomic_store(&started_at, 0);
+        uint64_t start = now_ns();
+        dispatch(pool, timed_job, NULL);
+        uint64_t ran;
+        while ((ran = atomic_load(&started_at)) == 0) {
+            sched_yield();
+        }
+        pickup[i] = ran - start;
+    }
+    while (atomic_load(&long_in_flight) > 0) {
+        sched_yield();
+    }
+    destroy_threadpool(pool);
+
+    qsort(pickup, MIXED_SAMPLES, sizeof(uint64_t), compare_samples);
+    printf("mutex  mixed %-5s short job to do_work p50 %8.2f us p99 %8.2f us\n",
+           lanes ? "lanes" : "fifo", pickup[MIXED_SAMPLES / 2] / 1e3, pickup[MIXED_SAMPLES * 99 / 100] / 1e3);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    int queue_size = argc > 2 ? atoi(argv[2]) : DEFAULT_QUEUE_SIZE;
+    long jobs = argc > 3 ? atol(argv[3]) : DEFAULT_JOBS;
+    if (queue_size <= CHILDREN_PER_PARENT) {
+        fprintf(stderr, "queue size must be larger than %d\n", CHILDREN_PER_PARENT);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d threads, queue size %d\n", threads, queue_size);
+    for (int spawn = 0; spawn <= 1; spawn++) {
+        run(THREADPOOL_QUEUE_MUTEX, spawn, threads, queue_size, jobs);
+        run(THREADPOOL_QUEUE_RING, spawn, threads, queue_size, jobs);
+        run(THREADPOOL_QUEUE_STEAL, spawn, threads, queue_size, jobs);
+    }
+    run_latency(THREADPOOL_QUEUE_MUTEX, threads, queue_size);
+    run_latency(THREADPOOL_QUEUE_RING, threads, queue_size);
+    run_latency(THREADPOOL_QUEUE_STEAL, threads, queue_size);
+    run_mixed(0, threads, queue_size);
+    run_mixed(1, threads, queue_size);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+#NOAM
+#
+# Runs the standard load scenarios against a fresh server on loopback, so
+# two builds can be compared on the same machine:
+#   bench/run_load.sh <server-binary> <bench_load-binary>
+# Environment: PORT (default 8090), THREADS (4), CONNECTIONS (32),
+# DURATION in seconds (10), RATE for the open-loop run (5000 req/s),
+# SERVER_ARGS for extra server options (e.g. --io=uring).
+
+set -e
+
+SERVER=$(realpath "$1")
+LOAD=$(realpath "$2")
+PORT=${PORT:-8090}
+THREADS=${THREADS:-4}
+CONNECTIONS=${CONNECTIONS:-32}
+DURATION=${DURATION:-10}
+RATE=${RATE:-5000}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOAD" ]; then
+    echo "usage: $0 <server-binary> <bench_load-binary>" >&2
+    exit 1
+fi
+
+# Document root with a spread of file sizes and a directory to list
+ROOT=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$ROOT"' EXIT
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+head -c 65536 /dev/urandom > "$ROOT/medium.bin"
+head -c 1048576 /dev/urandom > "$ROOT/large.bin"
+yes "a line of text for the compressible file" | head -c 32768 > "$ROOT/text.txt"
+mkdir "$ROOT/dir"
+i=0
+while [ $i -lt 1000 ]; do
+    : > "$ROOT/dir/entry$i"
+    i=$((i + 1))
+done
+chmod -R o+rX "$ROOT"
+
+cd "$ROOT"
+"$SERVER" "$PORT" "$THREADS" 200 2000000000 $SERVER_ARGS > /dev/null 2>&1 &
+SERVER_PID=$!
+cd - > /dev/null
+
+# Wait until it listens
+i=0
+while ! (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "server did not start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+MIX="--path=/small.bin:60 --path=/text.txt:15 --path=/medium.bin:15 --path=/large.bin:5 --path=/dir/:5"
+
+echo "== file mix, keep-alive"
+"$LOAD" --connections="$CONNECTIONS" --duration="$DURATION" $MIX "$PORT"
+echo "== file mix, a connection per request"
+"$LOAD" --connections="$CONNECTIONS" --duration="$DURATION" --no-keepalive $MIX "$PORT"
+echo "== file mix, open loop at $RATE req/s"
+"$LOAD" --connections="$CONNECTIONS" --duration="$DURATION" --rate="$RATE" $MIX "$PORT"
+echo "== directory listing"
+"$LOAD" --connections="$CONNECTIONS" --duration="$DURATION" --path=/dir/ "$PORT"
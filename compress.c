@@ -0,0 +1,91 @@
+//NOAM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "compress.h"
+
+char* gzip_compress(const char* data, size_t len, size_t* out_len) {
+    if (len < GZIP_MIN_SIZE) {
+        return NULL;
+    }
+
+    z_stream stream = { 0 };
+    // 15 window bits plus 16 asks zlib for a gzip header and trailer
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return NULL;
+    }
+
+    // deflateBound is enough to finish in one call
+    size_t bound = deflateBound(&stream, (uLong)len);
+    char* out = (char*)malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = (uInt)bound;
+    int rc = deflate(&stream, Z_FINISH);
+    size_t produced = stream.total_out;
+    deflateEnd(&stream);
+
+    if (rc != Z_STREAM_END || produced >= len) {
+        free(out);
+        return NULL;
+    }
+    *out_len = produced;
+    return out;
+}
+
+int gzip_stream_init(gzip_stream* gs, gzip_sink sink, void* ctx) {
+    memset(&gs->z, 0, sizeof(gs->z));
+    gs->sink = sink;
+    gs->ctx = ctx;
+    if (deflateInit2(&gs->z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Runs deflate until the input is consumed (or, finishing, the trailer is out)
+static int gzip_stream_run(gzip_stream* gs, int flush) {
+    char out[16384];
+    int rc;
+    do {
+        gs->z.next_out = (Bytef*)out;
+        gs->z.avail_out = sizeof(out);
+        rc = deflate(&gs->z, flush);
+        if (rc == Z_STREAM_ERROR) {
+            return -1;
+        }
+        size_t produced = sizeof(out) - gs->z.avail_out;
+        if (produced > 0 && gs->sink(gs->ctx, out, produced) < 0) {
+            return -1;
+        }
+    } while (gs->z.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    return 0;
+}
+
+int gzip_stream_write(gzip_stream* gs, const char* data, size_t len) {
+    gs->z.next_in = (Bytef*)data;
+    gs->z.avail_in = (uInt)len;
+    return gzip_stream_run(gs, Z_NO_FLUSH);
+}
+
+int gzip_stream_finish(gzip_stream* gs) {
+    gs->z.next_in = NULL;
+    gs->z.avail_in = 0;
+    int rc = gzip_stream_run(gs, Z_FINISH);
+    deflateEnd(&gs->z);
+    return rc;
+}
+
+void gzip_stream_abort(gzip_stream* gs) {
+    deflateEnd(&gs->z);
+}
@@ -0,0 +1,65 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+/**
+ * compress.h
+ *
+ * gzip encoding of response bodies through zlib. Used for generated
+ * pages and for the compressed variants of files kept in the file cache.
+ */
+
+// smaller bodies are sent as they are; the gzip framing would eat the savings
+#define GZIP_MIN_SIZE 256
+
+#define GZIP_LEVEL 6
+
+/**
+ * gzip_compress returns a malloc'ed gzip member holding data[0..len) and
+ * stores its size in *out_len. Returns NULL on failure or when the result
+ * would not be smaller than the input. The caller frees the result.
+ */
+char* gzip_compress(const char* data, size_t len, size_t* out_len);
+
+/**
+ * Receives compressed output as it is produced. Returns 0 to go on, -1 to
+ * make the writer fail.
+ */
+typedef int (*gzip_sink)(void* ctx, const char* data, size_t len);
+
+/**
+ * Incremental gzip encoder for bodies produced piece by piece, such as a
+ * streamed directory listing.
+ */
+typedef struct gzip_stream_st {
+    z_stream z;
+    gzip_sink sink;
+    void* ctx;
+} gzip_stream;
+
+/**
+ * gzip_stream_init prepares gs to hand its output to sink. Returns 0, or
+ * -1 if zlib could not be set up.
+ */
+int gzip_stream_init(gzip_stream* gs, gzip_sink sink, void* ctx);
+
+/**
+ * gzip_stream_write compresses data[0..len). Output is passed to the sink
+ * whenever zlib has some ready. Returns 0, or -1 once the sink failed.
+ */
+int gzip_stream_write(gzip_stream* gs, const char* data, size_t len);
+
+/**
+ * gzip_stream_finish flushes the rest of the output with the gzip trailer
+ * and releases the encoder. Returns 0, or -1 once the sink failed.
+ */
+int gzip_stream_finish(gzip_stream* gs);
+
+/**
+ * gzip_stream_abort releases an encoder that won't be finished.
+ */
+void gzip_stream_abort(gzip_stream* gs);
+
+#endif
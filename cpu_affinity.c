@@ -0,0 +1,146 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include "cpu_affinity.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+// Part part of parts equal runs of cpus; a CPU each, shared, when there are too few
+static void split(const int* cpus, int n, int parts, int part, cpu_set_t* out) {
+    CPU_ZERO(out);
+    if (n <= parts) {
+        CPU_SET(cpus[part % n], out);
+        return;
+    }
+    for (int i = (int)((long)part * n / parts); i < (int)((long)(part + 1) * n / parts); i++) {
+        CPU_SET(cpus[i], out);
+    }
+}
+
+// The CPUs of set in ascending order; returns how many
+static int list_cpus(const cpu_set_t* set, int* cpus) {
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set)) {
+            cpus[n++] = cpu;
+        }
+    }
+    return n;
+}
+
+// Parses a sysfs cpulist such as "0-3,8-11" into set
+static int read_cpulist(const char* path, cpu_set_t* set) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[4096];
+    int ok = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+
+    CPU_ZERO(set);
+    char* p = line;
+    while (*p >= '0' && *p <= '9') {
+        long first = strtol(p, &p, 10);
+        long last = first;
+        if (*p == '-') {
+            last = strtol(p + 1, &p, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+// Allowed CPUs of every NUMA node that has some, in node order; returns the node count
+static int read_nodes(const cpu_set_t* allowed, cpu_set_t* nodes, int max_nodes) {
+    int found[CPU_SETSIZE];
+    int count = 0;
+    DIR* dir = opendir(NODE_DIR);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL && count < max_nodes) {
+        int node;
+        char tail;
+        if (sscanf(de->d_name, "node%d%c", &node, &tail) == 1 && node >= 0) {
+            found[count++] = node;
+        }
+    }
+    closedir(dir);
+
+    // readdir() order is arbitrary; node numbers are small, so sort by insertion
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && found[j - 1] > found[j]; j--) {
+            int t = found[j];
+            found[j] = found[j - 1];
+            found[j - 1] = t;
+        }
+    }
+
+    int nodes_with_cpus = 0;
+    for (int i = 0; i < count; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", found[i]);
+        cpu_set_t cpus;
+        if (read_cpulist(path, &cpus) < 0) {
+            continue;
+        }
+        CPU_AND(&nodes[nodes_with_cpus], &cpus, allowed);
+        if (CPU_COUNT(&nodes[nodes_with_cpus]) > 0) {
+            nodes_with_cpus++;
+        }
+    }
+    return nodes_with_cpus;
+}
+
+int cpu_affinity_plan(cpu_pin_mode mode, int shards, cpu_set_t* sets) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    int* cpus = (int*)malloc(CPU_SETSIZE * sizeof(int));
+    if (!cpus) {
+        perror("malloc");
+        return -1;
+    }
+
+    int num_nodes = 0;
+    cpu_set_t* nodes = NULL;
+    if (mode == CPU_PIN_NUMA) {
+        nodes = (cpu_set_t*)malloc(CPU_SETSIZE * sizeof(cpu_set_t));
+        num_nodes = nodes ? read_nodes(&allowed, nodes, CPU_SETSIZE) : 0;
+    }
+
+    if (num_nodes == 0) {
+        int n = list_cpus(&allowed, cpus);
+        for (int i = 0; i < shards; i++) {
+            split(cpus, n, shards, i, &sets[i]);
+        }
+    }
+    else {
+        // Shard i lives on node i % num_nodes, next to the memory its threads touch
+        for (int node = 0; node < num_nodes; node++) {
+            int n = list_cpus(&nodes[node], cpus);
+            int on_node = shards / num_nodes + (node < shards % num_nodes);
+            for (int k = 0; k < on_node; k++) {
+                split(cpus, n, on_node, k, &sets[node + k * num_nodes]);
+            }
+        }
+    }
+
+    free(nodes);
+    free(cpus);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <sched.h>
+
+/**
+ * cpu_affinity.h
+ *
+ * Divides the CPUs the process may run on (its sched_getaffinity() mask)
+ * among the shards of the server, so each shard's threads stay on cores
+ * of their own. Callers need _GNU_SOURCE for cpu_set_t.
+ */
+
+typedef enum {
+    CPU_PIN_NONE,                   //threads run wherever the scheduler puts them
+    CPU_PIN_SPREAD,                 //each shard gets an equal run of the allowed CPUs
+    CPU_PIN_NUMA                    //shards go round-robin over NUMA nodes and split their node's CPUs
+} cpu_pin_mode;
+
+/**
+ * cpu_affinity_plan fills sets[0..shards) with the CPUs of each shard.
+ * With more shards than CPUs, shards share CPUs. CPU_PIN_NUMA behaves
+ * like CPU_PIN_SPREAD when no NUMA topology is exposed in sysfs.
+ * Returns 0, or -1 if the allowed CPUs can't be determined.
+ */
+int cpu_affinity_plan(cpu_pin_mode mode, int shards, cpu_set_t* sets);
+
+#endif
@@ -0,0 +1,239 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "dir_listing.h"
+
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define OUT_BUFFER_SIZE 8192
+
+// Batches the many small pieces of a row into sink calls of a few kilobytes
+typedef struct out_buffer_st {
+    listing_sink sink;
+    void* ctx;
+    int failed;                 // the sink said stop
+    size_t len;
+    char data[OUT_BUFFER_SIZE];
+} out_buffer;
+
+static void out_flush(out_buffer* out) {
+    if (out->len > 0 && !out->failed && out->sink(out->ctx, out->data, out->len) < 0) {
+        out->failed = 1;
+    }
+    out->len = 0;
+}
+
+static void out_append(out_buffer* out, const char* data, size_t len) {
+    while (len > 0 && !out->failed) {
+        size_t room = sizeof(out->data) - out->len;
+        size_t n = len < room ? len : room;
+        memcpy(out->data + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+        if (out->len == sizeof(out->data)) {
+            out_flush(out);
+        }
+    }
+}
+
+static void out_puts(out_buffer* out, const char* s) {
+    out_append(out, s, strlen(s));
+}
+
+// A file name may contain markup characters
+static void out_escaped(out_buffer* out, const char* s) {
+    const char* run = s;
+    for (; *s; s++) {
+        const char* entity = NULL;
+        switch (*s) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        default: continue;
+        }
+        out_append(out, run, (size_t)(s - run));
+        out_puts(out, entity);
+        run = s + 1;
+    }
+    out_append(out, run, (size_t)(s - run));
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int skip_entry(const char* name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+// Reads every name up front so they can be sorted; no stat() yet. The
+// names are packed into one growing block rather than allocated one by
+// one, so a big directory costs a few dozen allocations, not one per entry.
+static int read_names(dir_listing* listing) {
+    size_t* offsets = NULL;
+    size_t capacity = 0;
+    size_t pool_len = 0;
+    size_t pool_capacity = 0;
+    struct dirent* de;
+    while ((de = readdir(listing->dir)) != NULL) {
+        if (skip_entry(de->d_name)) continue;
+
+        if (listing->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            size_t* grown = (size_t*)realloc(offsets, capacity * sizeof(size_t));
+            if (!grown) {
+                free(offsets);
+                return -1;
+            }
+            offsets = grown;
+        }
+        size_t len = strlen(de->d_name) + 1;
+        if (pool_len + len > pool_capacity) {
+            pool_capacity = pool_capacity ? pool_capacity * 2 : 4096;
+            while (pool_capacity < pool_len + len) pool_capacity *= 2;
+            char* grown = (char*)realloc(listing->name_pool, pool_capacity);
+            if (!grown) {
+                free(offsets);
+                return -1;
+            }
+            listing->name_pool = grown;
+        }
+        memcpy(listing->name_pool + pool_len, de->d_name, len);
+        offsets[listing->count++] = pool_len;
+        pool_len += len;
+    }
+
+    // The pool has stopped moving; point into it
+    if (listing->count > 0) {
+        listing->names = (char**)malloc(listing->count * sizeof(char*));
+        if (!listing->names) {
+            free(offsets);
+            return -1;
+        }
+        for (size_t i = 0; i < listing->count; i++) {
+            listing->names[i] = listing->name_pool + offsets[i];
+        }
+    }
+    free(offsets);
+
+    if (listing->count > 1) {
+        qsort(listing->names, listing->count, sizeof(char*), compare_names);
+    }
+    return 0;
+}
+
+dir_listing* create_dir_listing(int dir_fd, listing_order order) {
+    dir_listing* listing = (dir_listing*)calloc(1, sizeof(dir_listing));
+    if (!listing) {
+        return NULL;
+    }
+    listing->order = order;
+
+    // A descriptor of its own, so the caller's one keeps its position
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    listing->dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!listing->dir) {
+        if (fd >= 0) close(fd);
+        free(listing);
+        return NULL;
+    }
+
+    if (order == LISTING_ORDER_NAME && read_names(listing) < 0) {
+        destroy_dir_listing(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+// One table row; entries that vanished or can't be stat()ed are left out
+static void render_entry(out_buffer* out, int dir_fd, const char* name) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) < 0) {
+        return;
+    }
+
+    out_puts(out, "<tr>\n<td><A HREF=\"");
+    out_escaped(out, name);
+    out_puts(out, "\">");
+    out_escaped(out, name);
+    out_puts(out, "</A></td><td>");
+
+    char timebuf[128];
+    struct tm tm;
+    size_t n = strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime_r(&st.st_mtime, &tm));
+    out_append(out, timebuf, n);
+
+    out_puts(out, "</td>\n<td>");
+    if (!S_ISDIR(st.st_mode)) {
+        char sizebuf[32];
+        int len = snprintf(sizebuf, sizeof(sizebuf), "%ld", (long)st.st_size);
+        out_append(out, sizebuf, (size_t)len);
+    }
+    out_puts(out, "</td>\n</tr>\n");
+}
+
+int dir_listing_render(dir_listing* listing, const char* path, listing_sink sink, void* ctx) {
+    out_buffer* out = (out_buffer*)malloc(sizeof(out_buffer));
+    if (!out) {
+        return -1;
+    }
+    out->sink = sink;
+    out->ctx = ctx;
+    out->failed = 0;
+    out->len = 0;
+
+    out_puts(out, "<HTML>\n<HEAD><TITLE>Index of ");
+    out_escaped(out, path);
+    out_puts(out, "</TITLE></HEAD>\r\n<BODY>\n<H4>Index of ");
+    out_escaped(out, path);
+    out_puts(out, "</H4>\n<table CELLSPACING=8>\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\n");
+
+    // Add the `..` entry manually
+    out_puts(out, "<tr>\n<td><A HREF=\"../\">..</A></td><td></td>\n<td></td>\n</tr>\n");
+
+    int dir_fd = dirfd(listing->dir);
+    if (listing->order == LISTING_ORDER_NAME) {
+        for (size_t i = 0; i < listing->count && !out->failed; i++) {
+            render_entry(out, dir_fd, listing->names[i]);
+        }
+    }
+    else {
+        struct dirent* de;
+        errno = 0;
+        while (!out->failed && (de = readdir(listing->dir)) != NULL) {
+            if (!skip_entry(de->d_name)) {
+                render_entry(out, dir_fd, de->d_name);
+            }
+            errno = 0;
+        }
+        if (errno != 0) {
+            out->failed = 1;    // the rest of the directory couldn't be read
+        }
+    }
+
+    out_puts(out, "</table>\n<HR>\n<ADDRESS>webserver/1.0</ADDRESS>\n</BODY></HTML>\n");
+    out_flush(out);
+
+    int rc = out->failed ? -1 : 0;
+    free(out);
+    return rc;
+}
+
+void destroy_dir_listing(dir_listing* listing) {
+    if (!listing) {
+        return;
+    }
+    free(listing->names);
+    free(listing->name_pool);
+    closedir(listing->dir);
+    free(listing);
+}
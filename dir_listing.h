@@ -0,0 +1,56 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+
+#include <stddef.h>
+#include <dirent.h>
+
+/**
+ * dir_listing.h
+ *
+ * Renders the HTML index of a directory as a stream. The page is handed
+ * to a sink a few kilobytes at a time while the entries are being read,
+ * so the first bytes go out before the last entry was stat()ed, and the
+ * cost is linear in the number of entries with no size limit. Entries
+ * are stat()ed with fstatat() relative to the open directory.
+ */
+
+typedef enum {
+    LISTING_ORDER_NAME,             //sorted by name, byte-wise
+    LISTING_ORDER_DISK              //in readdir() order, cheapest for huge directories
+} listing_order;
+
+/**
+ * Receives the rendered page piece by piece. Returns 0 to go on, -1 to
+ * stop rendering (the peer went away).
+ */
+typedef int (*listing_sink)(void* ctx, const char* data, size_t len);
+
+typedef struct dir_listing_st {
+    DIR* dir;
+    listing_order order;
+    char** names;                   //LISTING_ORDER_NAME: every entry, sorted
+    char* name_pool;                //the names themselves, back to back
+    size_t count;
+} dir_listing;
+
+/**
+ * create_dir_listing opens the directory at dir_fd (which stays open and
+ * is not moved) for listing. With LISTING_ORDER_NAME all names are read
+ * and sorted here; with LISTING_ORDER_DISK they are read while rendering.
+ * Returns NULL on failure, before anything was rendered.
+ */
+dir_listing* create_dir_listing(int dir_fd, listing_order order);
+
+/**
+ * dir_listing_render renders the index titled "Index of <path>" into
+ * sink. Returns 0, or -1 if the sink stopped it or the page couldn't be
+ * rendered in full.
+ */
+int dir_listing_render(dir_listing* listing, const char* path, listing_sink sink, void* ctx);
+
+/**
+ * destroy_dir_listing closes the directory and frees the names.
+ */
+void destroy_dir_listing(dir_listing* listing);
+
+#endif
@@ -0,0 +1,300 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "file_cache.h"
+
+// FNV-1a over the path
+static unsigned int hash_path(const char* path) {
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static file_cache_shard* shard_for(file_cache* cache, unsigned int hash) {
+    return &cache->shards[hash % FILE_CACHE_SHARDS];
+}
+
+static file_cache_entry** bucket_for(file_cache_shard* shard, unsigned int hash) {
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+}
+
+static int same_file(const file_cache_entry* e, const struct stat* st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static file_cache_entry* find_entry(file_cache_shard* shard, const char* path, unsigned int hash) {
+    for (file_cache_entry* e = *bucket_for(shard, hash); e; e = e->chain) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void free_entry(file_cache_entry* e) {
+    free(e->path);
+    free(e->header);
+    free(e->body);
+    free(e);
+}
+
+void file_cache_release(file_cache_entry* entry) {
+    if (entry && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free_entry(entry);
+    }
+}
+
+// Caller holds the shard's write lock
+static void remove_entry(file_cache* cache, file_cache_shard* shard, file_cache_entry* e) {
+    file_cache_entry** link = bucket_for(shard, e->hash);
+    while (*link != e) {
+        link = &(*link)->chain;
+    }
+    *link = e->chain;
+
+    if (e->ring_next == e) {
+        shard->hand = NULL;
+    }
+    else {
+        e->ring_prev->ring_next = e->ring_next;
+        e->ring_next->ring_prev = e->ring_prev;
+        if (shard->hand == e) {
+            shard->hand = e->ring_next;
+        }
+    }
+
+    shard->bytes -= e->charge;
+    atomic_fetch_sub(&cache->bytes, e->charge);
+    atomic_fetch_sub(&cache->entries, 1);
+    file_cache_release(e);      // readers may still be sending it
+}
+
+// Caller holds the shard's write lock. Entries join the ring right behind the hand.
+static void insert_entry(file_cache* cache, file_cache_shard* shard, file_cache_entry* e) {
+    file_cache_entry** bucket = bucket_for(shard, e->hash);
+    e->chain = *bucket;
+    *bucket = e;
+
+    if (!shard->hand) {
+        e->ring_prev = e;
+        e->ring_next = e;
+        shard->hand = e;
+    }
+    else {
+        e->ring_next = shard->hand;
+        e->ring_prev = shard->hand->ring_prev;
+        shard->hand->ring_prev->ring_next = e;
+        shard->hand->ring_prev = e;
+    }
+
+    shard->bytes += e->charge;
+    atomic_fetch_add(&cache->bytes, e->charge);
+    atomic_fetch_add(&cache->entries, 1);
+}
+
+// CLOCK sweep: give recently hit entries a second chance, evict the rest
+static void make_room(file_cache* cache, file_cache_shard* shard, size_t needed) {
+    size_t budget = cache->max_bytes / FILE_CACHE_SHARDS;
+    while (shard->hand && shard->bytes + needed > budget) {
+        file_cache_entry* e = shard->hand;
+        if (atomic_exchange(&e->referenced, 0)) {
+            shard->hand = e->ring_next;
+            continue;
+        }
+        remove_entry(cache, shard, e);
+        atomic_fetch_add(&cache->evictions, 1);
+    }
+}
+
+file_cache* create_file_cache(size_t max_bytes, size_t max_entry_size) {
+    if (max_bytes < FILE_CACHE_SHARDS || max_entry_size == 0) {
+        fprintf(stderr, "Invalid file cache parameters\n");
+        return NULL;
+    }
+
+    file_cache* cache = (file_cache*)calloc(1, sizeof(file_cache));
+    if (!cache) {
+        perror("calloc");
+        return NULL;
+    }
+
+    // An entry must fit into its shard's share of the budget
+    size_t shard_budget = max_bytes / FILE_CACHE_SHARDS;
+    cache->max_bytes = max_bytes;
+    cache->max_entry_size = max_entry_size < shard_budget ? max_entry_size : shard_budget;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        if (pthread_rwlock_init(&cache->shards[i].lock, NULL) != 0) {
+            perror("rwlock init");
+            while (--i >= 0) {
+                pthread_rwlock_destroy(&cache->shards[i].lock);
+            }
+            free(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+file_cache_entry* file_cache_lookup(file_cache* cache, const char* path, const struct stat* st) {
+    unsigned int hash = hash_path(path);
+    file_cache_shard* shard = shard_for(cache, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    file_cache_entry* e = find_entry(shard, path, hash);
+    if (e && same_file(e, st)) {
+        atomic_store_explicit(&e->referenced, 1, memory_order_relaxed);
+        atomic_fetch_add(&e->refs, 1);
+        pthread_rwlock_unlock(&shard->lock);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return e;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (e) {
+        // The file changed on disk; recheck under the write lock before dropping it
+        pthread_rwlock_wrlock(&shard->lock);
+        e = find_entry(shard, path, hash);
+        if (e && !same_file(e, st)) {
+            remove_entry(cache, shard, e);
+            atomic_fetch_add(&cache->invalidations, 1);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return NULL;
+}
+
+// An entry with room for body_len bytes of body, not yet in the table
+static file_cache_entry* alloc_entry(const char* path, const char* header, size_t header_len, size_t body_len) {
+    file_cache_entry* e = (file_cache_entry*)calloc(1, sizeof(file_cache_entry));
+    if (!e) {
+        return NULL;
+    }
+    e->path = strdup(path);
+    e->header = (char*)malloc(header_len + 1);
+    e->body = (char*)malloc(body_len > 0 ? body_len : 1);
+    if (!e->path || !e->header || !e->body) {
+        free_entry(e);
+        return NULL;
+    }
+
+    memcpy(e->header, header, header_len);
+    e->header[header_len] = '\0';
+    e->header_len = header_len;
+    e->body_len = body_len;
+    return e;
+}
+
+// Stamps e with st and adds it to the table, unless an equal entry won the race
+static file_cache_entry* publish_entry(file_cache* cache, file_cache_entry* e, const char* path, const struct stat* st) {
+    e->hash = hash_path(path);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->charge = sizeof(*e) + strlen(path) + 1 + e->header_len + 1 + e->body_len;
+    atomic_init(&e->refs, 2);           // the table's and the caller's
+    atomic_init(&e->referenced, 1);
+
+    file_cache_shard* shard = shard_for(cache, e->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+
+    file_cache_entry* existing = find_entry(shard, path, e->hash);
+    if (existing && same_file(existing, st)) {
+        // Another worker cached it first
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_rwlock_unlock(&shard->lock);
+        free_entry(e);
+        return existing;
+    }
+    if (existing) {
+        remove_entry(cache, shard, existing);
+        atomic_fetch_add(&cache->invalidations, 1);
+    }
+
+    make_room(cache, shard, e->charge);
+    insert_entry(cache, shard, e);
+    pthread_rwlock_unlock(&shard->lock);
+
+    atomic_fetch_add(&cache->insertions, 1);
+    return e;
+}
+
+file_cache_entry* file_cache_insert(file_cache* cache, const char* path, const struct stat* st, int fd,
+                                    const char* header, size_t header_len) {
+    if (!S_ISREG(st->st_mode) || st->st_size < 0 || (size_t)st->st_size > cache->max_entry_size) {
+        return NULL;
+    }
+
+    file_cache_entry* e = alloc_entry(path, header, header_len, (size_t)st->st_size);
+    if (!e) {
+        return NULL;
+    }
+
+    // Read the whole file; a short read means it changed under us
+    size_t done = 0;
+    while (done < e->body_len) {
+        ssize_t n = pread(fd, e->body + done, e->body_len - done, (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            free_entry(e);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+
+    return publish_entry(cache, e, path, st);
+}
+
+file_cache_entry* file_cache_insert_data(file_cache* cache, const char* key, const struct stat* st,
+                                         const char* header, size_t header_len,
+                                         const char* body, size_t body_len) {
+    // Derived from a file (its gzip encoding) or a directory (its listing)
+    if ((!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) || body_len > cache->max_entry_size) {
+        return NULL;
+    }
+
+    file_cache_entry* e = alloc_entry(key, header, header_len, body_len);
+    if (!e) {
+        return NULL;
+    }
+    memcpy(e->body, body, body_len);
+
+    return publish_entry(cache, e, key, st);
+}
+
+void file_cache_get_stats(file_cache* cache, file_cache_stats* out) {
+    out->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    out->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    out->insertions = atomic_load_explicit(&cache->insertions, memory_order_relaxed);
+    out->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    out->invalidations = atomic_load_explicit(&cache->invalidations, memory_order_relaxed);
+    out->entries = atomic_load_explicit(&cache->entries, memory_order_relaxed);
+    out->bytes = atomic_load_explicit(&cache->bytes, memory_order_relaxed);
+    out->max_bytes = cache->max_bytes;
+}
+
+void destroy_file_cache(file_cache* cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard* shard = &cache->shards[i];
+        while (shard->hand) {
+            remove_entry(cache, shard, shard->hand);
+        }
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    free(cache);
+}
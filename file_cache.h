@@ -0,0 +1,135 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * file_cache.h
+ *
+ * Byte-budgeted cache of small, frequently requested files shared by all
+ * pool threads. Each entry holds the file body and the pre-rendered
+ * entity headers (Content-Type, Content-Length, Last-Modified, ETag) so a hit
+ * needs neither open() nor read() nor a MIME lookup. Entries are
+ * validated against the caller's stat() result and dropped as soon as
+ * the inode, size or mtime changes.
+ *
+ * Entries are keyed by path. A derived representation of a file, such as
+ * its gzip encoding, is kept under a key of its own ("path gzip") and is
+ * validated against the stat() result of the file it was made from; an
+ * empty one records that there is nothing worth keeping, such as a file
+ * that doesn't compress or a listing too big to cache. A fresh
+ * foo.css.gz sidecar is kept as "path gzip sidecar", under its own stat(). A
+ * directory's rendered listing is kept the same way ("path listing").
+ *
+ * The cache is split into shards, each with its own reader/writer lock,
+ * hash table and CLOCK eviction ring. Lookups only take the read lock.
+ */
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 64      // hash buckets per shard
+
+typedef struct file_cache_entry_st {
+    char* path;                     //resolved path or variant key, the cache key
+    unsigned int hash;
+    dev_t dev;                      //identity used for invalidation
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char* header;                   //pre-rendered entity headers, CRLF terminated lines
+    size_t header_len;
+    char* body;                     //file contents
+    size_t body_len;
+    size_t charge;                  //bytes accounted against the budget
+    atomic_int refs;                //1 for the table plus one per reader
+    atomic_int referenced;          //CLOCK bit, set on every hit
+    struct file_cache_entry_st* chain;      //next entry in the hash bucket
+    struct file_cache_entry_st* ring_prev;  //CLOCK ring
+    struct file_cache_entry_st* ring_next;
+} file_cache_entry;
+
+typedef struct file_cache_shard_st {
+    pthread_rwlock_t lock;
+    file_cache_entry* buckets[FILE_CACHE_BUCKETS];
+    file_cache_entry* hand;         //CLOCK hand, NULL when the shard is empty
+    size_t bytes;                   //bytes currently charged to this shard
+} file_cache_shard;
+
+/**
+ * Counters, updated without locks.
+ */
+typedef struct file_cache_stats_st {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;        //entries dropped to stay within budget
+    unsigned long invalidations;    //entries dropped because the file changed
+    unsigned long entries;
+    unsigned long bytes;            //memory held by cached entries
+    unsigned long max_bytes;
+} file_cache_stats;
+
+typedef struct file_cache_st {
+    size_t max_bytes;               //total byte budget
+    size_t max_entry_size;          //larger files are never cached
+    file_cache_shard shards[FILE_CACHE_SHARDS];
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong insertions;
+    atomic_ulong evictions;
+    atomic_ulong invalidations;
+    atomic_ulong entries;
+    atomic_ulong bytes;
+} file_cache;
+
+/**
+ * create_file_cache creates an empty cache holding at most max_bytes of
+ * entries, none of whose bodies is larger than max_entry_size.
+ * Returns NULL on failure.
+ */
+file_cache* create_file_cache(size_t max_bytes, size_t max_entry_size);
+
+/**
+ * file_cache_lookup returns the entry for path if it is still valid for
+ * the given stat() result, NULL otherwise. A stale entry is removed.
+ * A returned entry must be released with file_cache_release.
+ */
+file_cache_entry* file_cache_lookup(file_cache* cache, const char* path, const struct stat* st);
+
+/**
+ * file_cache_insert reads the whole file from fd (which must describe
+ * st) and caches it together with the entity headers. Returns the new
+ * (or concurrently inserted) entry, to be released with
+ * file_cache_release, or NULL if the file can't or shouldn't be cached.
+ */
+file_cache_entry* file_cache_insert(file_cache* cache, const char* path, const struct stat* st, int fd,
+                                    const char* header, size_t header_len);
+
+/**
+ * file_cache_insert_data caches body_len bytes of already prepared body
+ * under key, valid for as long as the file or directory described by st
+ * is unchanged.
+ * Returns the entry like file_cache_insert, or NULL.
+ */
+file_cache_entry* file_cache_insert_data(file_cache* cache, const char* key, const struct stat* st,
+                                         const char* header, size_t header_len,
+                                         const char* body, size_t body_len);
+
+/**
+ * file_cache_release drops a reference obtained from lookup or insert.
+ */
+void file_cache_release(file_cache_entry* entry);
+
+/**
+ * file_cache_get_stats copies the current counters into out.
+ */
+void file_cache_get_stats(file_cache* cache, file_cache_stats* out);
+
+/**
+ * destroy_file_cache frees every entry. No reader may still hold one.
+ */
+void destroy_file_cache(file_cache* cache);
+
+#endif
@@ -0,0 +1,65 @@
+//NOAM
+
+#include <string.h>
+#include "header_builder.h"
+
+void header_builder_reset(header_builder* hb) {
+    hb->len = 0;
+    hb->overflow = 0;
+}
+
+void header_builder_append(header_builder* hb, const char* data, size_t len) {
+    if (hb->overflow || len > sizeof(hb->data) - hb->len) {
+        hb->overflow = 1;
+        return;
+    }
+    memcpy(hb->data + hb->len, data, len);
+    hb->len += len;
+}
+
+// Writes value in decimal to the end of buf and returns where it starts
+static char* format_number(char* end, long long value) {
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char* p = end;
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) {
+        *--p = '-';
+    }
+    return p;
+}
+
+void header_builder_status_line(header_builder* hb, int minor_version, int status, const char* title) {
+    char version[] = "HTTP/1.0 ";
+    version[7] = (char)('0' + minor_version);
+    header_builder_append(hb, version, sizeof(version) - 1);
+
+    char digits[24];
+    char* p = format_number(digits + sizeof(digits), status);
+    header_builder_append(hb, p, (size_t)(digits + sizeof(digits) - p));
+    header_builder_append(hb, " ", 1);
+    header_builder_append(hb, title, strlen(title));
+    header_builder_append(hb, "\r\n", 2);
+}
+
+void header_builder_add(header_builder* hb, const char* name, const char* value) {
+    header_builder_append(hb, name, strlen(name));
+    header_builder_append(hb, ": ", 2);
+    header_builder_append(hb, value, strlen(value));
+    header_builder_append(hb, "\r\n", 2);
+}
+
+void header_builder_add_number(header_builder* hb, const char* name, long long value) {
+    char digits[24];
+    char* p = format_number(digits + sizeof(digits), value);
+    header_builder_append(hb, name, strlen(name));
+    header_builder_append(hb, ": ", 2);
+    header_builder_append(hb, p, (size_t)(digits + sizeof(digits) - p));
+    header_builder_append(hb, "\r\n", 2);
+}
+
+void header_builder_end(header_builder* hb) {
+    header_builder_append(hb, "\r\n", 2);
+}
@@ -0,0 +1,56 @@
+#ifndef HEADER_BUILDER_H
+#define HEADER_BUILDER_H
+
+#include <stddef.h>
+
+/**
+ * header_builder.h
+ *
+ * Append-only buffer for a response head. Every append knows where the
+ * head ends, so building one costs a memcpy per piece instead of a
+ * strlen() over everything written so far. A builder is meant to be
+ * reset and reused for each response a thread sends.
+ *
+ * Appends that don't fit are dropped and mark the builder as overflowed;
+ * such a head must not be sent.
+ */
+
+#define HEADER_BUILDER_SIZE 4096
+
+typedef struct header_builder_st {
+    size_t len;                     //bytes used in data
+    int overflow;                   //1 once an append didn't fit
+    char data[HEADER_BUILDER_SIZE];
+} header_builder;
+
+/**
+ * header_builder_reset empties hb for the next response.
+ */
+void header_builder_reset(header_builder* hb);
+
+/**
+ * header_builder_append adds len raw bytes, e.g. pre-rendered header lines.
+ */
+void header_builder_append(header_builder* hb, const char* data, size_t len);
+
+/**
+ * header_builder_status_line adds "HTTP/1.<minor_version> <status> <title>".
+ */
+void header_builder_status_line(header_builder* hb, int minor_version, int status, const char* title);
+
+/**
+ * header_builder_add adds a "name: value" line.
+ */
+void header_builder_add(header_builder* hb, const char* name, const char* value);
+
+/**
+ * header_builder_add_number adds a "name: value" line with a decimal value.
+ */
+void header_builder_add_number(header_builder* hb, const char* name, long long value);
+
+/**
+ * header_builder_end adds the blank line that ends the head.
+ */
+void header_builder_end(header_builder* hb);
+
+#endif
@@ -0,0 +1,43 @@
+//NOAM
+
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include "http_date.h"
+
+typedef struct date_slot_st {
+    time_t second;
+    char text[HTTP_DATE_LEN + 1];
+} date_slot;
+
+static date_slot slots[HTTP_DATE_SLOTS];
+static _Atomic(date_slot*) current;     //last published slot, NULL before the first call
+static atomic_flag updating = ATOMIC_FLAG_INIT;
+static unsigned int next_slot;          //only touched while holding updating
+
+const char* http_date_now(void) {
+    time_t now = time(NULL);
+    date_slot* slot = atomic_load_explicit(&current, memory_order_acquire);
+    if (slot && slot->second == now) {
+        return slot->text;
+    }
+
+    // One thread renders the new second; the others keep the previous one meanwhile
+    if (!atomic_flag_test_and_set_explicit(&updating, memory_order_acquire)) {
+        date_slot* fresh = &slots[next_slot++ % HTTP_DATE_SLOTS];
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(fresh->text, sizeof(fresh->text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        fresh->second = now;
+        atomic_store_explicit(&current, fresh, memory_order_release);
+        atomic_flag_clear_explicit(&updating, memory_order_release);
+        return fresh->text;
+    }
+
+    // Only the very first callers can find nothing published yet
+    while (!slot) {
+        sched_yield();
+        slot = atomic_load_explicit(&current, memory_order_acquire);
+    }
+    return slot->text;
+}
@@ -0,0 +1,26 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+/**
+ * http_date.h
+ *
+ * The current time as an RFC 1123 date for the Date header, shared by
+ * all threads. Formatting it takes gmtime() and strftime(), so it is done
+ * at most once per second by whichever thread first notices the second
+ * changed; everyone else just reads the published string.
+ */
+
+// length of "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LEN 29
+
+// published strings are recycled round-robin, so one stays valid this many seconds
+#define HTTP_DATE_SLOTS 8
+
+/**
+ * http_date_now returns the current date, HTTP_DATE_LEN characters and a
+ * NUL. The string must be used right away and not kept: it is reused
+ * HTTP_DATE_SLOTS seconds later.
+ */
+const char* http_date_now(void);
+
+#endif
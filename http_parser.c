@@ -0,0 +1,286 @@
+//NOAM
+
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+
+enum {
+    ST_START,               // before the request line, stray blank lines are skipped
+    ST_METHOD,
+    ST_TARGET,
+    ST_VERSION,
+    ST_REQUEST_LINE_LF,     // saw CR at the end of the request line
+    ST_HEADER_START,
+    ST_HEADER_NAME,
+    ST_VALUE_START,
+    ST_VALUE,
+    ST_HEADER_LF,           // saw CR at the end of a header line
+    ST_HEAD_END_LF,         // saw CR on the blank line
+    ST_DONE,
+    ST_ERROR
+};
+
+// RFC 9110 token characters
+static int is_tchar(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+    switch (c) {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+':
+    case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Visible ASCII or obs-text; whitespace is handled by the callers
+static int is_vchar(unsigned char c) {
+    return (c > ' ' && c != 0x7f);
+}
+
+static http_parse_result fail(http_parser* p, int status) {
+    p->state = ST_ERROR;
+    p->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// End of the bytes the current line may use before it breaks a limit
+static size_t scan_end(const http_parser* p, size_t len, size_t max_line) {
+    size_t end = len;
+    if (end > p->limits.max_head_size) end = p->limits.max_head_size;
+    if (end > p->line_start + max_line) end = p->line_start + max_line;
+    return end;
+}
+
+static http_slice slice(const char* buf, size_t from, size_t to) {
+    http_slice s = { buf + from, to - from };
+    return s;
+}
+
+// "HTTP/" DIGIT "." DIGIT
+static int parse_version(http_parser* p, const char* v, size_t len) {
+    if (len != 8 || memcmp(v, "HTTP/", 5) != 0 || v[6] != '.' ||
+        v[5] < '0' || v[5] > '9' || v[7] < '0' || v[7] > '9') {
+        return 400;
+    }
+    p->major_version = v[5] - '0';
+    p->minor_version = v[7] - '0';
+    return p->major_version == 1 ? 0 : 505;
+}
+
+void http_parser_limits_init(http_parser_limits* limits) {
+    limits->max_request_line = HTTP_DEFAULT_MAX_REQUEST_LINE;
+    limits->max_header_line = HTTP_DEFAULT_MAX_HEADER_LINE;
+    limits->max_head_size = HTTP_DEFAULT_MAX_HEAD_SIZE;
+    limits->max_headers = HTTP_MAX_HEADERS;
+}
+
+void http_parser_init(http_parser* p, const http_parser_limits* limits) {
+    if (limits) {
+        p->limits = *limits;
+    }
+    else {
+        http_parser_limits_init(&p->limits);
+    }
+    if (p->limits.max_headers > HTTP_MAX_HEADERS) {
+        p->limits.max_headers = HTTP_MAX_HEADERS;
+    }
+
+    p->state = ST_START;
+    p->pos = 0;
+    p->line_start = 0;
+    p->mark = 0;
+    p->value_end = 0;
+    p->error_status = 0;
+    p->method.at = NULL;
+    p->method.len = 0;
+    p->target = p->method;
+    p->major_version = 0;
+    p->minor_version = 0;
+    p->num_headers = 0;
+    p->head_length = 0;
+}
+
+http_parse_result http_parser_execute(http_parser* p, const char* buf, size_t len) {
+    if (p->state == ST_DONE) return HTTP_PARSE_DONE;
+    if (p->state == ST_ERROR) return HTTP_PARSE_ERROR;
+
+    size_t pos = p->pos;
+    for (; pos < len; pos++) {
+        unsigned char c = (unsigned char)buf[pos];
+
+        if (pos >= p->limits.max_head_size) {
+            return fail(p, p->state <= ST_VERSION ? 414 : 431);
+        }
+        if (p->state <= ST_REQUEST_LINE_LF && p->state != ST_START &&
+            pos - p->line_start >= p->limits.max_request_line) {
+            return fail(p, 414);
+        }
+        if (p->state >= ST_HEADER_NAME && p->state <= ST_HEADER_LF &&
+            pos - p->line_start >= p->limits.max_header_line) {
+            return fail(p, 431);
+        }
+
+        switch (p->state) {
+        case ST_START:
+            if (c == '\r' || c == '\n') {
+                break;
+            }
+            p->line_start = pos;
+            p->mark = pos;
+            p->state = ST_METHOD;
+            // fall through
+        case ST_METHOD:
+            if (c == ' ') {
+                if (pos == p->mark) return fail(p, 400);
+                p->method = slice(buf, p->mark, pos);
+                p->mark = pos + 1;
+                p->state = ST_TARGET;
+            }
+            else if (!is_tchar(c)) {
+                return fail(p, 400);
+            }
+            break;
+
+        case ST_TARGET:
+            // Fast path over the bulk of the target
+            for (size_t end = scan_end(p, len, p->limits.max_request_line);
+                 pos + 1 < end && is_vchar(c); c = (unsigned char)buf[++pos]) {
+            }
+            if (c == ' ') {
+                if (pos == p->mark) return fail(p, 400);
+                p->target = slice(buf, p->mark, pos);
+                p->mark = pos + 1;
+                p->state = ST_VERSION;
+            }
+            else if (!is_vchar(c)) {
+                return fail(p, 400);    // includes HTTP/0.9 requests without a version
+            }
+            break;
+
+        case ST_VERSION:
+            if (c == '\r' || c == '\n') {
+                int status = parse_version(p, buf + p->mark, pos - p->mark);
+                if (status) return fail(p, status);
+                p->state = c == '\r' ? ST_REQUEST_LINE_LF : ST_HEADER_START;
+            }
+            else if (!is_vchar(c)) {
+                return fail(p, 400);
+            }
+            break;
+
+        case ST_REQUEST_LINE_LF:
+        case ST_HEADER_LF:
+            if (c != '\n') return fail(p, 400);
+            p->state = ST_HEADER_START;
+            break;
+
+        case ST_HEADER_START:
+            p->line_start = pos;
+            if (c == '\r') {
+                p->state = ST_HEAD_END_LF;
+            }
+            else if (c == '\n') {
+                p->state = ST_DONE;
+                p->pos = pos + 1;
+                p->head_length = pos + 1;
+                return HTTP_PARSE_DONE;
+            }
+            else if (is_tchar(c)) {
+                p->mark = pos;
+                p->state = ST_HEADER_NAME;
+            }
+            else {
+                return fail(p, 400);    // includes obsolete line folding
+            }
+            break;
+
+        case ST_HEADER_NAME:
+            for (size_t end = scan_end(p, len, p->limits.max_header_line);
+                 pos + 1 < end && is_tchar(c); c = (unsigned char)buf[++pos]) {
+            }
+            if (c == ':') {
+                if (p->num_headers >= p->limits.max_headers) return fail(p, 431);
+                p->headers[p->num_headers].name = slice(buf, p->mark, pos);
+                p->mark = pos + 1;
+                p->value_end = pos + 1;
+                p->state = ST_VALUE_START;
+            }
+            else if (!is_tchar(c)) {
+                return fail(p, 400);    // whitespace before the colon is not allowed
+            }
+            break;
+
+        case ST_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                p->mark = pos + 1;
+                p->value_end = pos + 1;
+                break;
+            }
+            p->state = ST_VALUE;
+            // fall through
+        case ST_VALUE:
+            for (size_t end = scan_end(p, len, p->limits.max_header_line);
+                 pos + 1 < end && (is_vchar(c) || c == ' ' || c == '\t'); c = (unsigned char)buf[++pos]) {
+                if (c > ' ') p->value_end = pos + 1;
+            }
+            if (c == '\r' || c == '\n') {
+                p->headers[p->num_headers].value = slice(buf, p->mark, p->value_end);
+                p->num_headers++;
+                p->state = c == '\r' ? ST_HEADER_LF : ST_HEADER_START;
+            }
+            else if (is_vchar(c)) {
+                p->value_end = pos + 1;
+            }
+            else if (c != ' ' && c != '\t') {
+                return fail(p, 400);
+            }
+            break;
+
+        case ST_HEAD_END_LF:
+            if (c != '\n') return fail(p, 400);
+            p->state = ST_DONE;
+            p->pos = pos + 1;
+            p->head_length = pos + 1;
+            return HTTP_PARSE_DONE;
+        }
+    }
+
+    p->pos = pos;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+const http_header* http_parser_find_header(const http_parser* p, const char* name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < p->num_headers; i++) {
+        const http_header* h = &p->headers[i];
+        if (h->name.len == name_len && strncasecmp(h->name.at, name, name_len) == 0) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+int http_slice_equals(http_slice s, const char* str) {
+    return strlen(str) == s.len && memcmp(s.at, str, s.len) == 0;
+}
+
+int http_slice_contains_token(http_slice s, const char* token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+
+    while (i < s.len) {
+        // One comma separated element, trimmed
+        while (i < s.len && (s.at[i] == ' ' || s.at[i] == '\t' || s.at[i] == ',')) i++;
+        size_t start = i;
+        while (i < s.len && s.at[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (s.at[end - 1] == ' ' || s.at[end - 1] == '\t')) end--;
+
+        if (end - start == token_len && strncasecmp(s.at + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
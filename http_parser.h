@@ -0,0 +1,112 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+/**
+ * http_parser.h
+ *
+ * Incremental HTTP/1.x request head parser. It never allocates and never
+ * copies: the method, target and header fields are slices of the caller's
+ * buffer. Feed it the same buffer again whenever more bytes arrived and it
+ * resumes where it stopped, so every byte is looked at once no matter how
+ * the request was split into TCP segments.
+ *
+ * Both CRLF and bare LF line endings are accepted. Obsolete header line
+ * folding is rejected.
+ */
+
+// most header fields kept per request
+#define HTTP_MAX_HEADERS 64
+
+#define HTTP_DEFAULT_MAX_REQUEST_LINE 4096
+#define HTTP_DEFAULT_MAX_HEADER_LINE 4096
+#define HTTP_DEFAULT_MAX_HEAD_SIZE 8192
+
+/**
+ * A piece of the parsed buffer. Not NUL terminated.
+ */
+typedef struct http_slice_st {
+    const char* at;
+    size_t len;
+} http_slice;
+
+typedef struct http_header_st {
+    http_slice name;
+    http_slice value;               //without surrounding whitespace
+} http_header;
+
+/**
+ * Size limits; a request exceeding one is rejected with the status in
+ * http_parser.error_status (414 for the request line, 431 otherwise).
+ */
+typedef struct http_parser_limits_st {
+    size_t max_request_line;
+    size_t max_header_line;         //one "Name: value" line
+    size_t max_head_size;           //request line plus all header lines
+    int max_headers;                //at most HTTP_MAX_HEADERS
+} http_parser_limits;
+
+typedef enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_DONE = 1
+} http_parse_result;
+
+typedef struct http_parser_st {
+    http_parser_limits limits;
+    int state;
+    size_t pos;                     //next byte to look at
+    size_t line_start;              //offset of the current line
+    size_t mark;                    //start of the token being parsed
+    size_t value_end;               //end of the header value without trailing whitespace
+    int error_status;               //HTTP status to answer a malformed request with
+
+    // Results, valid once http_parser_execute returned HTTP_PARSE_DONE
+    http_slice method;
+    http_slice target;
+    int major_version;
+    int minor_version;
+    http_header headers[HTTP_MAX_HEADERS];
+    int num_headers;
+    size_t head_length;             //bytes of the head including the blank line
+} http_parser;
+
+/**
+ * http_parser_limits_init fills limits with the HTTP_DEFAULT_* values.
+ */
+void http_parser_limits_init(http_parser_limits* limits);
+
+/**
+ * http_parser_init prepares p for a new request. limits may be NULL for
+ * the defaults.
+ */
+void http_parser_init(http_parser* p, const http_parser_limits* limits);
+
+/**
+ * http_parser_execute parses buf[0..len). Between calls buf must keep its
+ * address and its first bytes; only appending is allowed. Returns
+ * HTTP_PARSE_DONE once the blank line ending the head was seen,
+ * HTTP_PARSE_INCOMPLETE if more bytes are needed and HTTP_PARSE_ERROR
+ * for a malformed or oversized request.
+ */
+http_parse_result http_parser_execute(http_parser* p, const char* buf, size_t len);
+
+/**
+ * http_parser_find_header returns the first header called name (compared
+ * case-insensitively), or NULL.
+ */
+const http_header* http_parser_find_header(const http_parser* p, const char* name);
+
+/**
+ * http_slice_equals compares a slice with a NUL terminated string.
+ */
+int http_slice_equals(http_slice s, const char* str);
+
+/**
+ * http_slice_contains_token looks for token (case-insensitively) in a
+ * comma separated header value such as "keep-alive, Upgrade".
+ */
+int http_slice_contains_token(http_slice s, const char* token);
+
+#endif
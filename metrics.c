@@ -0,0 +1,207 @@
+//NOAM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+static const char* stage_names[METRIC_STAGE_COUNT] = {
+    [METRIC_QUEUE_WAIT] = "queue_wait",
+    [METRIC_PARSE] = "parse",
+    [METRIC_RESOLVE] = "resolve",
+    [METRIC_HANDLE] = "handle",
+    [METRIC_WRITE] = "write",
+    [METRIC_REQUEST] = "request",
+};
+
+// Prometheus bucket bounds in nanoseconds, from the fine buckets below them
+static const uint64_t export_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000, 2500000000u, 5000000000ull, 10000000000ull
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Every shard ever created, newest first; only ever pushed to
+static _Atomic(metrics_shard*) all_shards = NULL;
+static _Thread_local metrics_shard* local_shard = NULL;
+
+static metrics_shard* thread_shard(void) {
+    metrics_shard* shard = local_shard;
+    if (shard) {
+        return shard;
+    }
+    shard = (metrics_shard*)calloc(1, sizeof(metrics_shard));
+    if (!shard) {
+        return NULL;    // this thread goes uncounted
+    }
+    shard->next = atomic_load(&all_shards);
+    while (!atomic_compare_exchange_weak(&all_shards, &shard->next, shard)) {
+    }
+    local_shard = shard;
+    return shard;
+}
+
+// Single writer: a plain load and store, no locked read-modify-write
+static void bump(atomic_ulong* counter, unsigned long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static int bucket_index(uint64_t ns) {
+    if (ns < METRICS_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - METRICS_SUB_BUCKET_BITS;
+    int index = (shift + 1) * METRICS_SUB_BUCKETS + (int)((ns >> shift) & (METRICS_SUB_BUCKETS - 1));
+    return index < METRICS_BUCKETS ? index : METRICS_BUCKETS - 1;
+}
+
+// Smallest value that no longer falls into bucket index
+static uint64_t bucket_upper(int index) {
+    if (index < METRICS_SUB_BUCKETS) {
+        return (uint64_t)index + 1;
+    }
+    int shift = index / METRICS_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(index % METRICS_SUB_BUCKETS);
+    return (METRICS_SUB_BUCKETS + sub + 1) << shift;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_record(metric_stage stage, uint64_t ns) {
+    metrics_shard* shard = thread_shard();
+    if (shard) {
+        metrics_histogram* h = &shard->stages[stage];
+        bump(&h->counts[bucket_index(ns)], 1);
+        bump(&h->sum_ns, ns);
+    }
+}
+
+void metrics_count(metric_counter counter, unsigned long n) {
+    metrics_shard* shard = thread_shard();
+    if (shard) {
+        bump(&shard->counters[counter], n);
+    }
+}
+
+void metrics_count_status(int status) {
+    if (status >= 100 && status < 600) {
+        metrics_count((metric_counter)(METRIC_RESPONSES_1XX + status / 100 - 1), 1);
+    }
+}
+
+// One or more lines of output, formatted
+static int emit(metrics_sink sink, void* ctx, const char* fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return -1;
+    }
+    return sink(ctx, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+static unsigned long sum_counter(metric_counter counter) {
+    unsigned long total = 0;
+    for (metrics_shard* s = atomic_load(&all_shards); s; s = s->next) {
+        total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+int metrics_render(metrics_sink sink, void* ctx) {
+    int rc = 0;
+    rc |= emit(sink, ctx, "# HELP webserver_requests_total Requests served.\n"
+                          "# TYPE webserver_requests_total counter\n"
+                          "webserver_requests_total %lu\n", sum_counter(METRIC_REQUESTS));
+    rc |= emit(sink, ctx, "# HELP webserver_sent_bytes_total Bytes written to clients.\n"
+                          "# TYPE webserver_sent_bytes_total counter\n"
+                          "webserver_sent_bytes_total %lu\n", sum_counter(METRIC_BYTES_SENT));
+    rc |= emit(sink, ctx, "# HELP webserver_shed_requests_total Requests answered 503 under overload.\n"
+                          "# TYPE webserver_shed_requests_total counter\n");
+    rc |= emit(sink, ctx, "webserver_shed_requests_total{reason=\"admission\"} %lu\n"
+                          "webserver_shed_requests_total{reason=\"deadline\"} %lu\n"
+                          "webserver_shed_requests_total{reason=\"lane\"} %lu\n",
+               sum_counter(METRIC_REJECTED), sum_counter(METRIC_EXPIRED), sum_counter(METRIC_LANE_FULL));
+    rc |= emit(sink, ctx, "# HELP webserver_timeouts_total Connections closed on a read, idle or write deadline.\n"
+                          "# TYPE webserver_timeouts_total counter\n");
+    rc |= emit(sink, ctx, "webserver_timeouts_total{kind=\"header\"} %lu\n"
+                          "webserver_timeouts_total{kind=\"idle\"} %lu\n"
+                          "webserver_timeouts_total{kind=\"write\"} %lu\n",
+               sum_counter(METRIC_TIMEOUT_HEADER), sum_counter(METRIC_TIMEOUT_IDLE),
+               sum_counter(METRIC_TIMEOUT_WRITE));
+    rc |= emit(sink, ctx, "# HELP webserver_responses_total Responses by status class.\n"
+                          "# TYPE webserver_responses_total counter\n");
+    for (int c = 0; c < 5; c++) {
+        rc |= emit(sink, ctx, "webserver_responses_total{code=\"%dxx\"} %lu\n",
+                   c + 1, sum_counter((metric_counter)(METRIC_RESPONSES_1XX + c)));
+    }
+
+    // Shards are added up once per stage; both families below use the totals
+    uint64_t counts[METRIC_STAGE_COUNT][METRICS_BUCKETS];
+    uint64_t sums[METRIC_STAGE_COUNT];
+    uint64_t totals[METRIC_STAGE_COUNT];
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        memset(counts[stage], 0, sizeof(counts[stage]));
+        sums[stage] = 0;
+        totals[stage] = 0;
+        for (metrics_shard* s = atomic_load(&all_shards); s; s = s->next) {
+            metrics_histogram* h = &s->stages[stage];
+            for (int i = 0; i < METRICS_BUCKETS; i++) {
+                uint64_t n = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+                counts[stage][i] += n;
+                totals[stage] += n;
+            }
+            sums[stage] += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+        }
+    }
+
+    rc |= emit(sink, ctx, "# HELP webserver_stage_duration_seconds Time spent per request in each stage.\n"
+                          "# TYPE webserver_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < METRIC_STAGE_COUNT && rc == 0; stage++) {
+        const char* name = stage_names[stage];
+        uint64_t cumulative = 0;
+        int i = 0;
+        for (size_t b = 0; b < sizeof(export_bounds) / sizeof(export_bounds[0]); b++) {
+            for (; i < METRICS_BUCKETS && bucket_upper(i) <= export_bounds[b]; i++) {
+                cumulative += counts[stage][i];
+            }
+            rc |= emit(sink, ctx, "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                       name, export_bounds[b] / 1e9, (unsigned long long)cumulative);
+        }
+        rc |= emit(sink, ctx, "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                              "webserver_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                              "webserver_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                   name, (unsigned long long)totals[stage], name, sums[stage] / 1e9,
+                   name, (unsigned long long)totals[stage]);
+    }
+
+    rc |= emit(sink, ctx, "# HELP webserver_stage_duration_quantile_seconds Latency quantiles per stage, "
+                          "upper bound of the 12.5%% wide bucket holding them.\n"
+                          "# TYPE webserver_stage_duration_quantile_seconds gauge\n");
+    for (int stage = 0; stage < METRIC_STAGE_COUNT && rc == 0; stage++) {
+        if (totals[stage] == 0) continue;
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * (double)totals[stage]);
+            if (rank == 0) rank = 1;
+            uint64_t cumulative = 0;
+            int i = 0;
+            while (i < METRICS_BUCKETS - 1 && (cumulative += counts[stage][i]) < rank) {
+                i++;
+            }
+            rc |= emit(sink, ctx, "webserver_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                       stage_names[stage], quantiles[q], bucket_upper(i) / 1e9);
+        }
+    }
+    return rc ? -1 : 0;
+}
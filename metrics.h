@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * metrics.h
+ *
+ * Request counters and per-stage latency histograms. Every thread records
+ * into a shard of its own, so recording takes no lock and no locked
+ * instruction. A scrape adds the shards up while they keep changing, which
+ * is good enough for monitoring.
+ *
+ * The histograms are HDR style: each power of two of nanoseconds is split
+ * into METRICS_SUB_BUCKETS linear buckets, which keeps every recorded
+ * value within 12.5% from 1 ns up to about a minute.
+ */
+
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS 280         // up to 2^36 ns (68 s); slower samples land in the last bucket
+
+typedef enum {
+    METRIC_QUEUE_WAIT,              //request head complete until a worker picked it up
+    METRIC_PARSE,                   //parsing the request head
+    METRIC_RESOLVE,                 //opening the path and checking permissions
+    METRIC_HANDLE,                  //the rest of the work on the worker: cache, reads, rendering
+    METRIC_WRITE,                   //writing to the socket, sendfile() included
+    METRIC_REQUEST,                 //whole request on the worker
+    METRIC_STAGE_COUNT
+} metric_stage;
+
+typedef enum {
+    METRIC_REQUESTS,
+    METRIC_BYTES_SENT,
+    METRIC_REJECTED,                //turned away with 503 instead of being queued
+    METRIC_EXPIRED,                 //dropped with 503 after waiting past the queue deadline
+    METRIC_LANE_FULL,               //turned away because its threadpool lane was full
+    METRIC_TIMEOUT_HEADER,          //closed before a request head arrived in time
+    METRIC_TIMEOUT_IDLE,            //kept-alive connection closed after idling too long
+    METRIC_TIMEOUT_WRITE,           //response abandoned when the client stopped reading
+    METRIC_RESPONSES_1XX,           //the five classes must stay in order
+    METRIC_RESPONSES_2XX,
+    METRIC_RESPONSES_3XX,
+    METRIC_RESPONSES_4XX,
+    METRIC_RESPONSES_5XX,
+    METRIC_COUNTER_COUNT
+} metric_counter;
+
+typedef struct metrics_histogram_st {
+    atomic_ulong counts[METRICS_BUCKETS];
+    atomic_ulong sum_ns;
+} metrics_histogram;
+
+/**
+ * One thread's counters. Only the owner writes them; scrapes read them
+ * with relaxed loads. Shards are never freed, so the totals of threads
+ * that have exited are kept.
+ */
+typedef struct metrics_shard_st {
+    metrics_histogram stages[METRIC_STAGE_COUNT];
+    atomic_ulong counters[METRIC_COUNTER_COUNT];
+    struct metrics_shard_st* next;
+} metrics_shard;
+
+/**
+ * Receives rendered output. Returns 0 to go on, -1 to stop.
+ */
+typedef int (*metrics_sink)(void* ctx, const char* data, size_t len);
+
+/**
+ * metrics_now returns monotonic nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * metrics_record adds one sample of ns nanoseconds to stage.
+ */
+void metrics_record(metric_stage stage, uint64_t ns);
+
+/**
+ * metrics_count adds n to counter.
+ */
+void metrics_count(metric_counter counter, unsigned long n);
+
+/**
+ * metrics_count_status counts one response with the given status code.
+ */
+void metrics_count_status(int status);
+
+/**
+ * metrics_render writes every counter and histogram in the Prometheus
+ * text format. Histograms also get p50, p90, p99 and p99.9 gauges taken
+ * from the fine-grained buckets. Returns 0, or -1 if the sink stopped it.
+ */
+int metrics_render(metrics_sink sink, void* ctx);
+
+#endif
@@ -0,0 +1,466 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <linux/openat2.h>
+#include "path_resolver.h"
+
+#define WATCH_MASK (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+// Cleared the first time the kernel says it has no openat2()
+static atomic_int have_openat2 = 1;
+
+// FNV-1a over the path
+static unsigned int hash_path(const char* path) {
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int has_dotdot(const char* path) {
+    for (const char* p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int open_beneath(path_resolver* r, const char* path, int flags) {
+    if (atomic_load_explicit(&have_openat2, memory_order_relaxed)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = (unsigned long long)flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = (int)syscall(SYS_openat2, r->root_fd, path, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        atomic_store(&have_openat2, 0);
+    }
+
+    // No openat2(): at least don't let ".." climb out of the root
+    if (has_dotdot(path)) {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(r->root_fd, path, flags);
+}
+
+static resolved_dir** bucket_for(path_resolver* r, unsigned int hash) {
+    return &r->buckets[hash % PATH_RESOLVER_BUCKETS];
+}
+
+static resolved_dir* find_dir(path_resolver* r, const char* path, unsigned int hash) {
+    for (resolved_dir* d = *bucket_for(r, hash); d; d = d->next) {
+        if (d->hash == hash && strcmp(d->path, path) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// True if path is dir or lies below it
+static int is_under(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int compare_wd(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Removes the watches in wds (sorted and deduplicated in place) that no
+// cached directory uses anymore; several paths can lead to one directory.
+// Caller holds the write lock, so no walk is about to use them.
+static void release_watches(path_resolver* r, int* wds, int count) {
+    qsort(wds, (size_t)count, sizeof(int), compare_wd);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || wds[i] != wds[unique - 1]) {
+            wds[unique++] = wds[i];
+        }
+    }
+    char* in_use = (char*)calloc((size_t)(unique > 0 ? unique : 1), 1);
+    if (!in_use) {
+        return;     // the watches stay; only the limit suffers
+    }
+    for (int b = 0; b < PATH_RESOLVER_BUCKETS; b++) {
+        for (resolved_dir* d = r->buckets[b]; d; d = d->next) {
+            int* found = (int*)bsearch(&d->wd, wds, (size_t)unique, sizeof(int), compare_wd);
+            if (found) {
+                in_use[found - wds] = 1;
+            }
+        }
+    }
+    for (int i = 0; i < unique; i++) {
+        if (!in_use[i]) {
+            inotify_rm_watch(r->inotify_fd, wds[i]);
+        }
+    }
+    free(in_use);
+}
+
+// Drops the directories watched by wd and everything cached below them;
+// wd < 0 drops everything. Their watches go too, unless another cached
+// directory still uses them. Caller holds the write lock.
+static void invalidate_watch(path_resolver* r, int wd) {
+    char* victims[16];
+    int num_victims = 0;
+    int everything = wd < 0;
+    int* dropped = (int*)malloc(sizeof(int) * (size_t)(r->num_dirs > 0 ? r->num_dirs : 1));
+    int num_dropped = 0;
+
+    for (int b = 0; b < PATH_RESOLVER_BUCKETS && !everything; b++) {
+        for (resolved_dir* d = r->buckets[b]; d; d = d->next) {
+            if (d->wd != wd) continue;
+            if (num_victims == 16 || !(victims[num_victims] = strdup(d->path))) {
+                everything = 1;     // too many names for one inode; start over
+                break;
+            }
+            num_victims++;
+        }
+    }
+
+    for (int b = 0; b < PATH_RESOLVER_BUCKETS; b++) {
+        resolved_dir** link = &r->buckets[b];
+        while (*link) {
+            resolved_dir* d = *link;
+            int drop = everything;
+            for (int i = 0; i < num_victims && !drop; i++) {
+                drop = is_under(d->path, victims[i]);
+            }
+            if (drop) {
+                *link = d->next;
+                if (dropped) {
+                    dropped[num_dropped++] = d->wd;
+                }
+                free(d->path);
+                free(d);
+                r->num_dirs--;
+                atomic_fetch_add(&r->invalidations, 1);
+            }
+            else {
+                link = &d->next;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_victims; i++) {
+        free(victims[i]);
+    }
+    if (dropped) {
+        release_watches(r, dropped, num_dropped);
+        free(dropped);
+    }
+}
+
+// Waits for inotify events on the cached directories and drops their results
+static void* watch_loop(void* arg) {
+    path_resolver* r = (path_resolver*)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = r->inotify_fd, .events = POLLIN },
+        { .fd = r->wake_fd, .events = POLLIN }
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        ssize_t n = read(r->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&r->lock);
+        atomic_fetch_add(&r->generation, 1);
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                invalidate_watch(r, -1);
+            }
+            else if (ev->len == 0) {
+                invalidate_watch(r, ev->wd);    // about the directory itself, not an entry in it
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_rwlock_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+// Caches one directory's result unless an event arrived since the walk
+// began. Returns 1 if it did. Caller holds the write lock.
+static int insert_dir(path_resolver* r, const char* path, unsigned int hash, int permitted, int wd,
+                      unsigned long generation) {
+    if (atomic_load(&r->generation) != generation || r->num_dirs >= PATH_RESOLVER_MAX_DIRS ||
+        find_dir(r, path, hash)) {
+        return 0;
+    }
+    resolved_dir* d = (resolved_dir*)malloc(sizeof(resolved_dir));
+    if (!d || (d->path = strdup(path)) == NULL) {
+        free(d);
+        return 0;
+    }
+    d->hash = hash;
+    d->permitted = permitted;
+    d->wd = wd;
+    d->next = *bucket_for(r, hash);
+    *bucket_for(r, hash) = d;
+    r->num_dirs++;
+    return 1;
+}
+
+// Watches the directory open at fd, looks at it and caches the result.
+// It all happens under the write lock, so a watch can't be released
+// between being added and being used by the new entry.
+static int watch_dir(path_resolver* r, const char* dir, unsigned int hash, int fd, unsigned long generation,
+                     int* chain_watched) {
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    pthread_rwlock_wrlock(&r->lock);
+
+    // Watch before looking, so a chmod in between is not missed
+    int wd = inotify_add_watch(r->inotify_fd, proc_path, WATCH_MASK);
+    struct stat st;
+    int permitted = fstat(fd, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & S_IXOTH);
+    if (wd < 0) {
+        *chain_watched = 0;
+    }
+    else if (!insert_dir(r, dir, hash, permitted, wd, generation)) {
+        release_watches(r, &wd, 1);
+    }
+    pthread_rwlock_unlock(&r->lock);
+    return permitted;
+}
+
+// 1 if dir is searchable by others, from the cache or from the directory
+// itself. A hit on a directory is trusted for the chain above it, because
+// an event on any of those drops it; so dir is only cached while
+// *chain_watched says every directory above it is, and it clears the flag
+// when dir can't be watched or is a symlink.
+static int check_dir(path_resolver* r, const char* dir, unsigned long generation, int* chain_watched) {
+    unsigned int hash = hash_path(dir);
+    pthread_rwlock_rdlock(&r->lock);
+    resolved_dir* d = find_dir(r, dir, hash);
+    int permitted = d ? d->permitted : -1;
+    pthread_rwlock_unlock(&r->lock);
+    if (permitted >= 0) {
+        return permitted;
+    }
+
+    // A symlink can be pointed elsewhere without an event on any watched
+    // directory, so a component that is one is looked at on every walk
+    int fd = open_beneath(r, dir, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        close(fd);
+        *chain_watched = 0;
+        fd = open_beneath(r, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return 0;
+        }
+        permitted = fstat(fd, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & S_IXOTH);
+    }
+    else if (r->inotify_fd >= 0 && *chain_watched) {
+        permitted = watch_dir(r, dir, hash, fd, generation, chain_watched);
+    }
+    else {
+        *chain_watched = 0;
+        permitted = S_ISDIR(st.st_mode) && (st.st_mode & S_IXOTH);
+    }
+    close(fd);
+    return permitted;
+}
+
+// Every directory in path above its last component must be searchable by others
+static int check_parents(path_resolver* r, const char* path) {
+    char parent[PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--;
+    while (len > 0 && path[len - 1] != '/') len--;
+    while (len > 0 && path[len - 1] == '/') len--;
+    if (len == 0) {
+        return 1;   // directly in the root
+    }
+    if (len >= sizeof(parent)) {
+        return 0;
+    }
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+
+    // Taken before any lookup, so results seen by a walk that raced with an event are not kept
+    unsigned long generation = atomic_load(&r->generation);
+
+    // The common case: the whole chain was checked before
+    pthread_rwlock_rdlock(&r->lock);
+    resolved_dir* d = find_dir(r, parent, hash_path(parent));
+    int permitted = d ? d->permitted : -1;
+    pthread_rwlock_unlock(&r->lock);
+    if (permitted >= 0) {
+        atomic_fetch_add_explicit(&r->dir_hits, 1, memory_order_relaxed);
+        return permitted;
+    }
+    atomic_fetch_add_explicit(&r->dir_misses, 1, memory_order_relaxed);
+
+    // Check each prefix from the top, stopping at the first closed one
+    int chain_watched = 1;
+    for (size_t i = 1; i <= len; i++) {
+        if (i < len && (parent[i] != '/' || parent[i - 1] == '/')) continue;
+        char saved = parent[i];
+        parent[i] = '\0';
+        permitted = check_dir(r, parent, generation, &chain_watched);
+        parent[i] = saved;
+        if (!permitted) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+path_resolver* create_path_resolver(const char* root) {
+    path_resolver* r = (path_resolver*)calloc(1, sizeof(path_resolver));
+    if (!r) {
+        perror("malloc");
+        return NULL;
+    }
+
+    r->root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (r->root_fd < 0) {
+        perror("open document root");
+        free(r);
+        return NULL;
+    }
+    if (pthread_rwlock_init(&r->lock, NULL) != 0) {
+        perror("rwlock init");
+        close(r->root_fd);
+        free(r);
+        return NULL;
+    }
+    atomic_init(&r->generation, 0);
+    atomic_init(&r->lookups, 0);
+    atomic_init(&r->dir_hits, 0);
+    atomic_init(&r->dir_misses, 0);
+    atomic_init(&r->invalidations, 0);
+
+    // Without inotify every request walks its directories again
+    r->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->inotify_fd < 0 || r->wake_fd < 0 ||
+        pthread_create(&r->watcher, NULL, watch_loop, r) != 0) {
+        perror("inotify watcher");
+        if (r->inotify_fd >= 0) close(r->inotify_fd);
+        if (r->wake_fd >= 0) close(r->wake_fd);
+        r->inotify_fd = -1;
+        r->wake_fd = -1;
+    }
+    return r;
+}
+
+int path_resolve(path_resolver* r, const char* path, struct stat* st, int* status) {
+    while (*path == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += *path == '/' ? 1 : 2;
+    }
+    if (*path == '\0') {
+        path = ".";
+    }
+    atomic_fetch_add_explicit(&r->lookups, 1, memory_order_relaxed);
+
+    // O_NONBLOCK so opening a FIFO doesn't wait for a writer
+    int fd = open_beneath(r, path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG) {
+            *status = 404;
+        }
+        else if (errno == EXDEV || errno == EACCES || errno == EPERM || errno == ELOOP) {
+            *status = 403;
+        }
+        else {
+            *status = 500;
+        }
+        return -1;
+    }
+
+    if (fstat(fd, st) < 0) {
+        close(fd);
+        *status = 500;
+        return -1;
+    }
+
+    int permitted = (S_ISREG(st->st_mode) && (st->st_mode & S_IROTH)) ||
+                    (S_ISDIR(st->st_mode) && (st->st_mode & S_IXOTH));
+    if (!permitted || !check_parents(r, path)) {
+        close(fd);
+        *status = 403;
+        return -1;
+    }
+    return fd;
+}
+
+void path_resolver_get_stats(path_resolver* r, path_resolver_stats* out) {
+    out->lookups = atomic_load(&r->lookups);
+    out->dir_hits = atomic_load(&r->dir_hits);
+    out->dir_misses = atomic_load(&r->dir_misses);
+    out->invalidations = atomic_load(&r->invalidations);
+    pthread_rwlock_rdlock(&r->lock);
+    out->dirs = (unsigned long)r->num_dirs;
+    pthread_rwlock_unlock(&r->lock);
+}
+
+void destroy_path_resolver(path_resolver* r) {
+    if (!r) {
+        return;
+    }
+    if (r->inotify_fd >= 0) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+        }
+        pthread_join(r->watcher, NULL);
+        close(r->inotify_fd);
+        close(r->wake_fd);
+    }
+
+    for (int b = 0; b < PATH_RESOLVER_BUCKETS; b++) {
+        resolved_dir* d = r->buckets[b];
+        while (d) {
+            resolved_dir* next = d->next;
+            free(d->path);
+            free(d);
+            d = next;
+        }
+    }
+    pthread_rwlock_destroy(&r->lock);
+    close(r->root_fd);
+    free(r);
+}
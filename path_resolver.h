@@ -0,0 +1,93 @@
+#ifndef PATH_RESOLVER_H
+#define PATH_RESOLVER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+/**
+ * path_resolver.h
+ *
+ * Turns a request path into an open file descriptor beneath the document
+ * root. Every lookup starts from a directory fd opened once at startup and
+ * goes through openat2() with RESOLVE_BENEATH, so neither ".." nor a
+ * symlink can lead outside the root. The fd returned is the one the
+ * request goes on to fstat(), sendfile() or list.
+ *
+ * A file is served only if it is a regular file readable by others or a
+ * directory searchable by others, and every directory above it is
+ * searchable by others. The result for each directory is cached. An
+ * inotify watch on every cached directory drops its result, and those of
+ * the directories below it, as soon as it is chmod'ed, moved or deleted;
+ * the watch goes with the last result that uses it. A symlinked component
+ * can be repointed without any of that, so it and everything below it are
+ * checked on every lookup instead.
+ *
+ * On kernels without openat2() paths containing a ".." component are
+ * refused and the rest is opened with plain openat().
+ */
+
+#define PATH_RESOLVER_BUCKETS 256
+#define PATH_RESOLVER_MAX_DIRS 4096     // directories whose result is cached at most
+
+typedef struct resolved_dir_st {
+    char* path;                     //relative to the root, e.g. "dir1/dir2"
+    unsigned int hash;
+    int permitted;                  //it and every directory above it are searchable by others
+    int wd;                         //inotify watch descriptor
+    struct resolved_dir_st* next;
+} resolved_dir;
+
+/**
+ * Counters, updated without locks.
+ */
+typedef struct path_resolver_stats_st {
+    unsigned long lookups;
+    unsigned long dir_hits;         //parent directory answered from the cache
+    unsigned long dir_misses;       //parent directories walked
+    unsigned long invalidations;    //cached directories dropped on an inotify event
+    unsigned long dirs;             //directories currently cached
+} path_resolver_stats;
+
+typedef struct path_resolver_st {
+    int root_fd;                    //O_PATH descriptor of the document root
+    int inotify_fd;                 //-1 when results can't be cached
+    int wake_fd;                    //eventfd that stops the watcher
+    pthread_t watcher;
+    pthread_rwlock_t lock;          //protects the table
+    resolved_dir* buckets[PATH_RESOLVER_BUCKETS];
+    int num_dirs;
+    atomic_ulong generation;        //bumped by every inotify event
+    atomic_ulong lookups;
+    atomic_ulong dir_hits;
+    atomic_ulong dir_misses;
+    atomic_ulong invalidations;
+} path_resolver;
+
+/**
+ * create_path_resolver opens root and starts the thread that watches
+ * cached directories. Returns NULL on failure.
+ */
+path_resolver* create_path_resolver(const char* root);
+
+/**
+ * path_resolve opens path beneath the root; leading "/" and "./" are
+ * ignored and an empty path is the root itself. On success it returns a
+ * read-only descriptor, which the caller closes, and fills *st.
+ * On failure it returns -1 and sets *status to the HTTP status to answer
+ * with: 404 if there is no such file, 403 if it may not be served or lies
+ * outside the root, 500 otherwise.
+ */
+int path_resolve(path_resolver* resolver, const char* path, struct stat* st, int* status);
+
+/**
+ * path_resolver_get_stats copies the current counters into out.
+ */
+void path_resolver_get_stats(path_resolver* resolver, path_resolver_stats* out);
+
+/**
+ * destroy_path_resolver stops the watcher and frees the cache.
+ */
+void destroy_path_resolver(path_resolver* resolver);
+
+#endif
@@ -0,0 +1,523 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "reactor.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 256
+
+static uint64_t monotonic_ms(void) {
+    return metrics_now() / 1000000;
+}
+
+static void link_connection(reactor* r, connection* conn) {
+    conn->prev = NULL;
+    conn->next = r->idle;
+    if (r->idle) {
+        r->idle->prev = conn;
+    }
+    r->idle = conn;
+}
+
+static void unlink_connection(reactor* r, connection* conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        r->idle = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+static void wake_reactor(reactor* r) {
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+}
+
+static void free_connections(reactor* r) {
+    while (r->free_conns) {
+        connection* next = r->free_conns->next;
+        free(r->free_conns);
+        r->free_conns = next;
+    }
+    r->num_free = 0;
+}
+
+reactor* create_reactor(int listen_fd, threadpool* pool, request_handler handler,
+                        int keepalive_timeout, int keepalive_requests) {
+    if (listen_fd < 0 || !pool || !handler || keepalive_timeout <= 0 || keepalive_requests <= 0) {
+        fprintf(stderr, "Invalid reactor parameters\n");
+        return NULL;
+    }
+
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return NULL;
+    }
+
+    reactor* r = (reactor*)malloc(sizeof(reactor));
+    if (!r) {
+        perror("malloc");
+        return NULL;
+    }
+
+    r->listen_fd = listen_fd;
+    r->pool = pool;
+    r->handler = handler;
+    r->keepalive_timeout = keepalive_timeout;
+    r->header_timeout = REACTOR_DEFAULT_HEADER_TIMEOUT;
+    r->keepalive_requests = keepalive_requests;
+    r->max_requests = 0;
+    http_parser_limits_init(&r->parser_limits);
+    memset(&r->overload, 0, sizeof(r->overload));
+    r->reject = NULL;
+    r->classify = NULL;
+    atomic_init(&r->queue_wait_avg, 0);
+    atomic_init(&r->dispatched, 0);
+    r->claimed = &r->dispatched;
+    r->peer = r;
+    r->idle = NULL;
+    timer_wheel_init(&r->timers, monotonic_ms(), REACTOR_TICK_MS);
+    r->resumed = NULL;
+    r->free_conns = NULL;
+    r->num_free = 0;
+    r->epoll_fd = -1;
+    r->wake_fd = -1;
+
+    if (pthread_mutex_init(&r->resume_lock, NULL) != 0) {
+        perror("mutex init");
+        free(r);
+        return NULL;
+    }
+    if (pthread_mutex_init(&r->free_lock, NULL) != 0) {
+        perror("mutex init");
+        pthread_mutex_destroy(&r->resume_lock);
+        free(r);
+        return NULL;
+    }
+
+    // Accepting the first connections must not have to allocate either
+    for (int i = 0; i < CONN_POOL_PREALLOC; i++) {
+        connection* conn = (connection*)malloc(sizeof(connection));
+        if (!conn) {
+            perror("malloc");
+            goto fail;
+        }
+        conn->next = r->free_conns;
+        r->free_conns = conn;
+        r->num_free++;
+    }
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->epoll_fd < 0 || r->wake_fd < 0) {
+        perror("epoll_create1 or eventfd");
+        goto fail;
+    }
+
+    // data.ptr == NULL marks the listening socket, data.ptr == r the wake-up eventfd
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        goto fail;
+    }
+    ev.data.ptr = r;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        goto fail;
+    }
+
+    return r;
+
+fail:
+    if (r->epoll_fd >= 0) close(r->epoll_fd);
+    if (r->wake_fd >= 0) close(r->wake_fd);
+    free_connections(r);
+    pthread_mutex_destroy(&r->free_lock);
+    pthread_mutex_destroy(&r->resume_lock);
+    free(r);
+    return NULL;
+}
+
+static connection* get_connection(reactor* r) {
+    pthread_mutex_lock(&r->free_lock);
+    connection* conn = r->free_conns;
+    if (conn) {
+        r->free_conns = conn->next;
+        r->num_free--;
+    }
+    pthread_mutex_unlock(&r->free_lock);
+    return conn ? conn : (connection*)malloc(sizeof(connection));
+}
+
+void connection_close(connection* conn) {
+    if (!conn) return;
+    close(conn->fd);
+
+    reactor* r = conn->owner;
+    pthread_mutex_lock(&r->free_lock);
+    if (r->num_free < CONN_POOL_MAX) {
+        conn->next = r->free_conns;
+        r->free_conns = conn;
+        r->num_free++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&r->free_lock);
+    free(conn);     // past the cap after a burst
+}
+
+static void reset_parser(connection* conn) {
+    http_parser_limits limits = conn->owner->parser_limits;
+
+    // A head must leave room in the buffer, so one that doesn't fit is
+    // reported as too large instead of waiting for bytes that never come
+    if (limits.max_head_size > CONN_BUFFER_SIZE - 2) {
+        limits.max_head_size = CONN_BUFFER_SIZE - 2;
+    }
+    http_parser_init(&conn->parser, &limits);
+}
+
+http_parse_result connection_parse(connection* conn) {
+    uint64_t start = metrics_now();
+    http_parse_result rc = http_parser_execute(&conn->parser, conn->buf, (size_t)conn->len);
+    conn->parse_ns += metrics_now() - start;
+    return rc;
+}
+
+void connection_consume(connection* conn, int n) {
+    if (n >= conn->len) {
+        conn->len = 0;
+    }
+    else {
+        memmove(conn->buf, conn->buf + n, conn->len - n);
+        conn->len -= n;
+    }
+    conn->buf[conn->len] = '\0';
+    reset_parser(conn);
+}
+
+void reactor_share_budget(reactor* r, reactor* other) {
+    r->claimed = other->claimed;
+    r->peer = other->peer;
+    other->peer = r;
+}
+
+int reactor_claim_request(reactor* r) {
+    int n = atomic_load(r->claimed);
+    while (n < r->max_requests) {
+        if (atomic_compare_exchange_weak(r->claimed, &n, n + 1)) {
+            if (n + 1 == r->max_requests) {
+                // let every reactor_run sharing the budget notice the limit
+                reactor* p = r;
+                do {
+                    wake_reactor(p);
+                    p = p->peer;
+                } while (p != r);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int reactor_accepting(reactor* r) {
+    return atomic_load(r->claimed) < r->max_requests;
+}
+
+void reactor_resume(connection* conn) {
+    reactor* r = conn->owner;
+
+    pthread_mutex_lock(&r->resume_lock);
+    conn->next = r->resumed;
+    r->resumed = conn;
+    pthread_mutex_unlock(&r->resume_lock);
+
+    wake_reactor(r);
+}
+
+static void accept_connections(reactor* r) {
+    // Edge-triggered: drain the backlog until accept4 would block
+    while (1) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept4(r->listen_fd, (struct sockaddr*)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        connection* conn = get_connection(r);
+        if (!conn) {
+            perror("malloc");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->len = 0;
+        conn->eof = 0;
+        conn->requests = 0;
+        conn->head_started = monotonic_ms();
+        conn->parse_ns = 0;
+        conn->dispatched_at = 0;
+        conn->queue_ns = 0;
+        conn->peer = peer;
+        conn->buf[0] = '\0';
+        conn->owner = r;
+        memset(&conn->timer, 0, sizeof(conn->timer));
+        reset_parser(conn);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            connection_close(conn);
+            continue;
+        }
+        link_connection(r, conn);
+        timer_wheel_schedule(&r->timers, &conn->timer,
+                             conn->head_started + (uint64_t)r->header_timeout * 1000);
+    }
+}
+
+/**
+ * Read everything the socket has to offer and parse the new bytes.
+ * Returns 1 if a full (or malformed) request head is buffered, 0 if
+ * more bytes are needed and -1 if the connection should be dropped.
+ */
+static int read_request(connection* conn) {
+    while (conn->len < CONN_BUFFER_SIZE - 1) {
+        ssize_t n = read(conn->fd, conn->buf + conn->len, CONN_BUFFER_SIZE - 1 - conn->len);
+        if (n > 0) {
+            conn->len += (int)n;
+            continue;
+        }
+        if (n == 0) {
+            conn->eof = 1;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
+    }
+    conn->buf[conn->len] = '\0';
+
+    // Malformed and oversized heads are handed over too; the handler rejects them
+    if (connection_parse(conn) != HTTP_PARSE_INCOMPLETE) {
+        return 1;
+    }
+    return conn->eof ? -1 : 0;
+}
+
+static void drop_connection(reactor* r, connection* conn) {
+    unlink_connection(r, conn);
+    timer_wheel_cancel(&r->timers, &conn->timer);
+    connection_close(conn);     // close() also removes it from the epoll set
+}
+
+// The head deadline runs from its first byte and isn't moved by later
+// ones, so a client trickling a byte at a time can't hold on to the socket
+static void watch_head(reactor* r, connection* conn, uint64_t now) {
+    if (conn->head_started == 0 && conn->len > 0) {
+        conn->head_started = now;
+        timer_wheel_schedule(&r->timers, &conn->timer, now + (uint64_t)r->header_timeout * 1000);
+    }
+}
+
+static void expire_connection(timer_entry* t, void* ctx) {
+    connection* conn = (connection*)((char*)t - offsetof(connection, timer));
+    metrics_count(conn->head_started ? METRIC_TIMEOUT_HEADER : METRIC_TIMEOUT_IDLE, 1);
+    drop_connection((reactor*)ctx, conn);
+}
+
+// Runs first on the worker: accounts for the queue wait and drops the
+// request unserved if it waited past the deadline
+static int pick_up(void* arg) {
+    connection* conn = (connection*)arg;
+    reactor* r = conn->owner;
+
+    uint64_t waited = metrics_now() - conn->dispatched_at;
+    conn->dispatched_at = 0;
+    conn->queue_ns = waited;
+    metrics_record(METRIC_QUEUE_WAIT, waited);
+
+    // Weight 1/8: follows a change of load within a few dozen requests
+    uint64_t avg = atomic_load_explicit(&r->queue_wait_avg, memory_order_relaxed);
+    atomic_store_explicit(&r->queue_wait_avg, avg - avg / 8 + waited / 8, memory_order_relaxed);
+
+    if (r->overload.deadline_ms > 0 && r->reject &&
+        waited > (uint64_t)r->overload.deadline_ms * 1000000) {
+        metrics_count(METRIC_EXPIRED, 1);
+        return r->reject(conn);
+    }
+    return r->handler(conn);
+}
+
+// Whether a new request should be turned away rather than queued. The
+// reactor is the only thread that queues jobs, so below queue_limit the
+// dispatch that follows never blocks.
+static int overloaded(reactor* r) {
+    if (!r->reject || (r->overload.queue_limit <= 0 && r->overload.wait_budget_ms <= 0)) {
+        return 0;
+    }
+    int queued = threadpool_queue_size(r->pool);
+    if (r->overload.queue_limit > 0 && queued >= r->overload.queue_limit) {
+        return 1;
+    }
+    // The average only moves when requests are picked up, so it can't keep
+    // shedding once the queue has drained
+    return r->overload.wait_budget_ms > 0 && queued > 0 &&
+           atomic_load_explicit(&r->queue_wait_avg, memory_order_relaxed) >
+               (uint64_t)r->overload.wait_budget_ms * 1000000;
+}
+
+// Hand the connection over; the worker owns the socket from now on
+static void hand_over(reactor* r, connection* conn) {
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    unlink_connection(r, conn);
+    timer_wheel_cancel(&r->timers, &conn->timer);
+    conn->head_started = 0;
+
+    if (overloaded(r)) {
+        metrics_count(METRIC_REJECTED, 1);
+        r->reject(conn);
+        return;
+    }
+
+    // A lane at its limit sheds its own requests instead of making the
+    // reactor wait, which would hold up the requests of every other lane
+    int lane = r->classify ? r->classify(conn) : 0;
+    if (threadpool_lane_full(r->pool, lane)) {
+        metrics_count(METRIC_LANE_FULL, 1);
+        if (r->reject) {
+            r->reject(conn);
+        }
+        else {
+            connection_close(conn);
+        }
+        return;
+    }
+    if (!reactor_claim_request(r)) {
+        connection_close(conn);
+        return;
+    }
+    conn->dispatched_at = metrics_now();
+    dispatch_lane(r->pool, lane, pick_up, conn);
+}
+
+static void take_back_resumed(reactor* r) {
+    uint64_t count;
+    while (read(r->wake_fd, &count, sizeof(count)) > 0) {
+        // drain the eventfd counter
+    }
+
+    pthread_mutex_lock(&r->resume_lock);
+    connection* conn = r->resumed;
+    r->resumed = NULL;
+    pthread_mutex_unlock(&r->resume_lock);
+
+    uint64_t now = monotonic_ms();
+    while (conn) {
+        connection* next = conn->next;
+        link_connection(r, conn);
+        timer_wheel_schedule(&r->timers, &conn->timer, now + (uint64_t)r->keepalive_timeout * 1000);
+        watch_head(r, conn, now);     // part of a pipelined request is left over
+
+        // Adding the socket reports bytes that arrived while a worker owned it
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            drop_connection(r, conn);
+        }
+        conn = next;
+    }
+}
+
+int reactor_run(reactor* r, int max_requests) {
+    struct epoll_event events[MAX_EVENTS];
+
+    r->max_requests = max_requests;
+    while (reactor_accepting(r)) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, REACTOR_TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return -1;
+        }
+
+        for (int i = 0; i < n && reactor_accepting(r); i++) {
+            connection* conn = (connection*)events[i].data.ptr;
+            if (!conn) {
+                accept_connections(r);
+                continue;
+            }
+            if (events[i].data.ptr == r) {
+                take_back_resumed(r);
+                continue;
+            }
+
+            int ready = read_request(conn);
+            if (ready < 0 || (ready == 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))) {
+                drop_connection(r, conn);
+                continue;
+            }
+
+            if (ready == 1) {
+                hand_over(r, conn);
+            }
+            else {
+                watch_head(r, conn, monotonic_ms());
+            }
+        }
+
+        timer_wheel_advance(&r->timers, monotonic_ms(), expire_connection, r);
+    }
+
+    return 0;
+}
+
+void destroy_reactor(reactor* r) {
+    if (!r) return;
+
+    while (r->idle) {
+        drop_connection(r, r->idle);
+    }
+    while (r->resumed) {
+        connection* next = r->resumed->next;
+        connection_close(r->resumed);
+        r->resumed = next;
+    }
+
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->listen_fd, NULL);
+    close(r->wake_fd);
+    close(r->epoll_fd);
+    free_connections(r);
+    pthread_mutex_destroy(&r->free_lock);
+    pthread_mutex_destroy(&r->resume_lock);
+    free(r);
+}
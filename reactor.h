@@ -0,0 +1,187 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "threadpool.h"
+#include "http_parser.h"
+#include "timer_wheel.h"
+
+/**
+ * reactor.h
+ *
+ * Edge-triggered epoll front end. The reactor owns the listening socket
+ * and every idle client socket; it reads until a full request head is
+ * buffered and only then hands the connection to the threadpool.
+ * Persistent connections come back to the reactor through
+ * reactor_resume once their response has been written.
+ *
+ * Every connection the reactor owns has one deadline on a timer wheel:
+ * a request head must be complete within header_timeout seconds of its
+ * first byte (of the accept on a new connection), however slowly it
+ * trickles in, and a kept-alive connection with nothing buffered is
+ * closed after keepalive_timeout seconds.
+ */
+
+// size of the per-connection request buffer
+#define CONN_BUFFER_SIZE 8192
+
+// connections allocated up front by each reactor, and closed ones kept for reuse
+#define CONN_POOL_PREALLOC 64
+#define CONN_POOL_MAX 1024
+
+#define REACTOR_DEFAULT_HEADER_TIMEOUT 10
+#define REACTOR_TICK_MS 100             //granularity of the connection deadlines
+
+typedef struct reactor_st reactor;
+
+/**
+ * A client connection. While it is registered with the reactor only the
+ * reactor thread touches it; once dispatched it belongs to the worker.
+ */
+typedef struct connection_st {
+    int fd;                         //client socket (non-blocking)
+    int len;                        //number of bytes in buf
+    int eof;                        //1 if the peer shut down its write side
+    int requests;                   //number of requests served on this connection
+    uint64_t head_started;          //monotonic ms the current request head began, 0 while idle
+    uint64_t parse_ns;              //time spent parsing the current request head
+    uint64_t dispatched_at;         //metrics_now() when handed to the pool, 0 once picked up
+    uint64_t queue_ns;              //time the current request waited for a worker
+    struct sockaddr_storage peer;   //client address
+    char buf[CONN_BUFFER_SIZE];     //raw request bytes, NUL terminated
+    http_parser parser;             //state of the request at the start of buf
+    reactor* owner;
+    timer_entry timer;              //header or idle deadline while the reactor owns it
+    struct connection_st* prev;     //reactor's list of idle connections
+    struct connection_st* next;
+} connection;
+
+/**
+ * request_handler is run on a pool thread with a connection whose
+ * buffer holds a complete request head. The handler owns the connection
+ * from that point and must either release it with connection_close or
+ * give it back with reactor_resume.
+ */
+typedef int (*request_handler)(connection*);
+
+/**
+ * request_classifier picks the threadpool lane of a connection whose
+ * buffer holds a complete request head. It runs on the reactor thread,
+ * so it must be cheap and must not block.
+ */
+typedef int (*request_classifier)(const connection*);
+
+/**
+ * Admission control. A request is turned away with the reject handler
+ * instead of being queued when queue_limit requests are already queued,
+ * or when recent requests waited longer than wait_budget_ms for a worker
+ * (while some are still waiting). A queued request whose wait passed
+ * deadline_ms is rejected by the worker that picks it up, without being
+ * served. 0 turns a check off.
+ */
+typedef struct reactor_overload_st {
+    int queue_limit;
+    int wait_budget_ms;
+    int deadline_ms;
+} reactor_overload;
+
+struct reactor_st {
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;                    //eventfd poked by reactor_resume
+    threadpool* pool;
+    request_handler handler;
+    int keepalive_timeout;          //seconds an idle connection is kept open
+    int header_timeout;             //seconds a request head may take, may be changed before reactor_run
+    int keepalive_requests;         //max requests served on one connection
+    int max_requests;               //total requests before reactor_run returns
+    http_parser_limits parser_limits;   //request head limits, may be changed before reactor_run
+    reactor_overload overload;      //admission control, may be changed before reactor_run
+    request_handler reject;         //answers a shed request and closes it; must not block
+    request_classifier classify;    //lane of each request, NULL queues all on lane 0; may be changed before reactor_run
+    _Atomic uint64_t queue_wait_avg;    //moving average of the queue wait, ns
+    atomic_int dispatched;          //requests claimed so far, unless claimed points elsewhere
+    atomic_int* claimed;            //counter max_requests applies to; reactors of one server share one
+    reactor* peer;                  //next reactor sharing claimed, a ring that leads back to this one
+    connection* idle;               //connections waiting for request bytes, most recent first
+    timer_wheel timers;             //their deadlines
+    pthread_mutex_t resume_lock;    //protects resumed
+    connection* resumed;            //connections handed back by workers
+    pthread_mutex_t free_lock;      //protects free_conns and num_free
+    connection* free_conns;         //closed connections kept for the next accept
+    int num_free;
+};
+
+/**
+ * create_reactor registers the (already listening) socket with a new
+ * epoll instance. The socket is switched to non-blocking mode.
+ * Idle connections are closed after keepalive_timeout seconds and
+ * at most keepalive_requests requests are served per connection.
+ * Returns NULL on failure.
+ */
+reactor* create_reactor(int listen_fd, threadpool* pool, request_handler handler,
+                        int keepalive_timeout, int keepalive_requests);
+
+/**
+ * reactor_run accepts connections and dispatches ready requests until
+ * max_requests requests were claimed. Returns 0 on success and -1 if
+ * epoll failed.
+ */
+int reactor_run(reactor* r, int max_requests);
+
+/**
+ * destroy_reactor closes every connection still owned by the reactor
+ * and frees it. The listening socket is left to the caller.
+ * Call it only after the threadpool has been destroyed.
+ */
+void destroy_reactor(reactor* r);
+
+/**
+ * reactor_share_budget makes r count its requests against the same
+ * max_requests as other, so several reactors stop after max_requests
+ * requests in total. Call it before either reactor runs.
+ */
+void reactor_share_budget(reactor* r, reactor* other);
+
+/**
+ * reactor_claim_request reserves one request out of max_requests.
+ * Workers call it before serving a pipelined request themselves.
+ * Returns 1 on success and 0 once the limit has been reached.
+ */
+int reactor_claim_request(reactor* r);
+
+/**
+ * reactor_accepting returns 1 while more requests may be claimed.
+ */
+int reactor_accepting(reactor* r);
+
+/**
+ * reactor_resume gives a kept-alive connection back to the reactor,
+ * which waits for its next request. Safe to call from any thread.
+ */
+void reactor_resume(connection* conn);
+
+/**
+ * connection_parse feeds the bytes buffered so far to the connection's
+ * parser, which picks up where the previous call stopped.
+ * Returns the http_parser_execute result.
+ */
+http_parse_result connection_parse(connection* conn);
+
+/**
+ * connection_consume drops the first n buffered bytes, keeping any
+ * pipelined request that follows them, and resets the parser for it.
+ */
+void connection_consume(connection* conn, int n);
+
+/**
+ * connection_close closes the client socket and returns the connection
+ * to its reactor's pool (up to CONN_POOL_MAX are kept, the rest are freed).
+ * Safe to call from any thread.
+ */
+void connection_close(connection* conn);
+
+#endif
@@ -1,163 +1,1023 @@
-//NOAM
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <pthread.h>
-#include <string.h>
-#include "threadpool.h"
-
-threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size) {
-    if (num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL || max_queue_size <= 0 || max_queue_size > MAXW_IN_QUEUE) {
-        fprintf(stderr, "Invalid threadpool parameters\n");
-        return NULL;
-    }
-
-    threadpool* pool = (threadpool*)malloc(sizeof(threadpool));
-    if (!pool) {
-        perror("malloc");
-        return NULL;
-    }
-
-    pool->num_threads = num_threads_in_pool;
-    pool->qsize = 0;
-    pool->max_qsize = max_queue_size;
-    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads_in_pool);
-    pool->qhead = NULL;
-    pool->qtail = NULL;
-    pool->shutdown = 0;
-    pool->dont_accept = 0;
-
-    if (pthread_mutex_init(&(pool->qlock), NULL) != 0 ||
-        pthread_cond_init(&(pool->q_not_empty), NULL) != 0 ||
-        pthread_cond_init(&(pool->q_empty), NULL) != 0 ||
-        pthread_cond_init(&(pool->q_not_full), NULL) != 0) {
-        perror("mutex or cond init");
-        free(pool->threads);
-        free(pool);
-        return NULL;
-    }
-
-    for (int i = 0; i < num_threads_in_pool; i++) {
-        if (pthread_create(&(pool->threads[i]), NULL, do_work, (void*)pool) != 0) {
-            perror("pthread_create");
-            destroy_threadpool(pool);
-            return NULL;
-        }
-    }
-
-    return pool;
-}
-
-void dispatch(threadpool* pool, dispatch_fn dispatch_to_here, void* arg) {
-    if (!pool || pool->dont_accept) {
-        return;
-    }
-
-    work_t* work = (work_t*)malloc(sizeof(work_t));
-    if (!work) {
-        perror("malloc");
-        return;
-    }
-
-    work->routine = dispatch_to_here;
-    work->arg = arg;
-    work->next = NULL;
-
-    pthread_mutex_lock(&(pool->qlock));
-
-    while (pool->qsize >= pool->max_qsize && !pool->shutdown) {
-        pthread_cond_wait(&(pool->q_not_full), &(pool->qlock));
-    }
-
-    if (pool->shutdown) {
-        pthread_mutex_unlock(&(pool->qlock));
-        free(work);
-        return;
-    }
-
-    if (pool->qtail) {
-        pool->qtail->next = work;
-    }
-    else {
-        pool->qhead = work;
-    }
-    pool->qtail = work;
-    pool->qsize++;
-
-    pthread_cond_signal(&(pool->q_not_empty));
-    pthread_mutex_unlock(&(pool->qlock));
-}
-
-void* do_work(void* p) {
-    threadpool* pool = (threadpool*)p;
-
-    while (1) {
-        pthread_mutex_lock(&(pool->qlock));
-
-        while (pool->qsize == 0 && !pool->shutdown) {
-            pthread_cond_wait(&(pool->q_not_empty), &(pool->qlock));
-        }
-
-        if (pool->shutdown) {
-            pthread_mutex_unlock(&(pool->qlock));
-            pthread_exit(NULL);
-        }
-
-        work_t* work = pool->qhead;
-        if (work) {
-            pool->qhead = work->next;
-            if (!pool->qhead) {
-                pool->qtail = NULL;
-            }
-            pool->qsize--;
-
-            if (pool->qsize == 0) {
-                pthread_cond_signal(&(pool->q_empty));
-            }
-        }
-
-        pthread_cond_signal(&(pool->q_not_full));
-        pthread_mutex_unlock(&(pool->qlock));
-
-        if (work) {
-            work->routine(work->arg);
-            free(work);
-        }
-    }
-
-    pthread_exit(NULL);
-}
-
-void destroy_threadpool(threadpool* pool) {
-    if (!pool) return;
-
-    pthread_mutex_lock(&(pool->qlock));
-    pool->dont_accept = 1;
-
-    while (pool->qsize > 0) {
-        pthread_cond_wait(&(pool->q_empty), &(pool->qlock));
-    }
-
-    pool->shutdown = 1;
-    pthread_cond_broadcast(&(pool->q_not_empty));
-    pthread_mutex_unlock(&(pool->qlock));
-
-    for (int i = 0; i < pool->num_threads; i++) {
-        pthread_join(pool->threads[i], NULL);
-    }
-
-    free(pool->threads);
-
-    work_t* current;
-    while (pool->qhead) {
-        current = pool->qhead;
-        pool->qhead = pool->qhead->next;
-        free(current);
-    }
-
-    pthread_mutex_destroy(&(pool->qlock));
-    pthread_cond_destroy(&(pool->q_not_empty));
-    pthread_cond_destroy(&(pool->q_empty));
-    pthread_cond_destroy(&(pool->q_not_full));
-    free(pool);
-}
+//NOAM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "threadpool.h"
+
+// how many inbox jobs a stealing-mode worker moves to its deque at once
+#define STEAL_BATCH 8
+
+// the stealing-mode worker running on this thread, if any
+static _Thread_local ws_worker* current_worker = NULL;
+
+// the pool thread running on this thread, if any
+static _Thread_local thread_slot* current_slot = NULL;
+
+static void* do_work_steal(void* p);
+
+static int futex_wait(atomic_uint* word, unsigned int expected) {
+    return (int)syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// Like futex_wait, but gives up after timeout_ms (< 0 waits forever)
+static int futex_wait_ms(atomic_uint* word, unsigned int expected, long timeout_ms) {
+    if (timeout_ms < 0) {
+        return futex_wait(word, expected);
+    }
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+    return (int)syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, &ts, NULL, 0);
+}
+
+static long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int is_elastic(threadpool* pool) {
+    return pool->max_threads > pool->num_threads;
+}
+
+static void futex_wake(atomic_uint* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void threadpool_config_init(threadpool_config* config, int num_threads_in_pool, int max_queue_size) {
+    config->num_threads = num_threads_in_pool;
+    config->max_queue_size = max_queue_size;
+    config->queue_kind = THREADPOOL_QUEUE_MUTEX;
+    config->placement = THREADPOOL_PLACE_ROUND_ROBIN;
+    config->max_threads = num_threads_in_pool;
+    config->grow_wait_ms = THREADPOOL_DEFAULT_GROW_WAIT_MS;
+    config->idle_timeout_ms = THREADPOOL_DEFAULT_IDLE_TIMEOUT_MS;
+    config->thread_start = NULL;
+    config->thread_start_arg = NULL;
+    config->num_lanes = 1;
+    memset(config->lanes, 0, sizeof(config->lanes));
+    config->lanes[0].weight = 1;
+}
+
+threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size) {
+    threadpool_config config;
+    threadpool_config_init(&config, num_threads_in_pool, max_queue_size);
+    return create_threadpool_with_config(&config);
+}
+
+static int init_ring(ring_queue* ring, int capacity) {
+    size_t bytes = sizeof(ring_slot) * (size_t)capacity;
+    ring->slots = (ring_slot*)aligned_alloc(THREADPOOL_CACHE_LINE, bytes);
+    if (!ring->slots) {
+        return -1;
+    }
+
+    // Slot i is free for the producer that claims position i
+    for (int i = 0; i < capacity; i++) {
+        atomic_init(&ring->slots[i].seq, (size_t)i);
+        ring->slots[i].routine = NULL;
+        ring->slots[i].arg = NULL;
+    }
+    ring->capacity = (size_t)capacity;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+static int init_workers(threadpool* pool) {
+    // Every queued job fits in any single deque or inbox, so pushes never fail
+    long capacity = 1;
+    while (capacity < pool->max_qsize) {
+        capacity <<= 1;
+    }
+
+    pool->workers = (ws_worker*)aligned_alloc(THREADPOOL_CACHE_LINE, sizeof(ws_worker) * pool->num_threads);
+    if (!pool->workers) {
+        return -1;
+    }
+    memset(pool->workers, 0, sizeof(ws_worker) * pool->num_threads);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        ws_worker* w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        w->rng = (unsigned int)i * 2654435761u + 1;
+        w->deque.mask = capacity - 1;
+        atomic_init(&w->deque.top, 0);
+        atomic_init(&w->deque.bottom, 0);
+        w->deque.slots = (ws_slot*)calloc((size_t)capacity, sizeof(ws_slot));
+        if (!w->deque.slots || init_ring(&w->inbox, pool->max_qsize) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_workers(threadpool* pool) {
+    if (!pool->workers) return;
+    for (int i = 0; i < pool->num_threads; i++) {
+        free(pool->workers[i].deque.slots);
+        free(pool->workers[i].inbox.slots);
+    }
+    free(pool->workers);
+}
+
+static void* run_thread(void* p) {
+    thread_slot* slot = (thread_slot*)p;
+    current_slot = slot;
+    if (slot->pool->thread_start) {
+        slot->pool->thread_start(slot->pool->thread_start_arg);
+    }
+    if (slot->pool->queue_kind == THREADPOOL_QUEUE_STEAL) {
+        return do_work_steal(&slot->pool->workers[slot->index]);
+    }
+    return do_work(slot->pool);
+}
+
+// Caller holds resize_lock
+static int start_thread(threadpool* pool, int index) {
+    thread_slot* slot = &pool->thread_slots[index];
+    if (slot->state == THREAD_SLOT_EXITED) {
+        pthread_join(pool->threads[index], NULL);
+        slot->state = THREAD_SLOT_FREE;
+    }
+
+    if (pthread_create(&(pool->threads[index]), NULL, run_thread, slot) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    slot->state = THREAD_SLOT_RUNNING;
+
+    int live = atomic_fetch_add(&pool->live_threads, 1) + 1;
+    if (live > pool->peak_threads) {
+        pool->peak_threads = live;
+    }
+    return 0;
+}
+
+// Add one thread, at most once per grow_wait_ms so a burst doesn't overshoot
+static void grow_pool(threadpool* pool) {
+    pthread_mutex_lock(&(pool->resize_lock));
+    long now = monotonic_ms();
+    if (!atomic_load(&pool->shutdown) && atomic_load(&pool->live_threads) < pool->max_threads &&
+        now - pool->last_grow_ms >= pool->grow_wait_ms) {
+        for (int i = 0; i < pool->max_threads; i++) {
+            if (pool->thread_slots[i].state != THREAD_SLOT_RUNNING) {
+                if (start_thread(pool, i) == 0) {
+                    pool->last_grow_ms = now;
+                    atomic_fetch_add(&pool->grown, 1);
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(pool->resize_lock));
+}
+
+// Called by an idle thread; returns 1 if it should exit now
+static int retire_thread(threadpool* pool) {
+    int retire = 0;
+    pthread_mutex_lock(&(pool->resize_lock));
+    if (current_slot && atomic_load(&pool->live_threads) > pool->num_threads) {
+        current_slot->state = THREAD_SLOT_EXITED;
+        atomic_fetch_sub(&pool->live_threads, 1);
+        atomic_fetch_add(&pool->retired, 1);
+        retire = 1;
+    }
+    pthread_mutex_unlock(&(pool->resize_lock));
+    return retire;
+}
+
+// How long an idle thread may keep waiting: -1 forever, 0 if it should retire
+static long idle_budget_ms(threadpool* pool, long idle_since) {
+    if (atomic_load(&pool->live_threads) <= pool->num_threads) {
+        return -1;
+    }
+    long left = idle_since + pool->idle_timeout_ms - monotonic_ms();
+    return left > 0 ? left : 0;
+}
+
+threadpool* create_threadpool_with_config(const threadpool_config* config) {
+    int num_threads_in_pool = config->num_threads;
+    int max_queue_size = config->max_queue_size;
+    if (num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL || max_queue_size <= 0 || max_queue_size > MAXW_IN_QUEUE) {
+        fprintf(stderr, "Invalid threadpool parameters\n");
+        return NULL;
+    }
+    int max_threads = config->max_threads;
+    if (max_threads < num_threads_in_pool || max_threads > MAXT_IN_POOL ||
+        (max_threads > num_threads_in_pool && (config->grow_wait_ms < 0 || config->idle_timeout_ms <= 0))) {
+        fprintf(stderr, "Invalid threadpool thread bounds\n");
+        return NULL;
+    }
+    if (max_threads > num_threads_in_pool && config->queue_kind == THREADPOOL_QUEUE_STEAL) {
+        fprintf(stderr, "A work-stealing threadpool can't change its size\n");
+        return NULL;
+    }
+    if (config->num_lanes < 1 || config->num_lanes > THREADPOOL_MAX_LANES ||
+        (config->num_lanes > 1 && config->queue_kind != THREADPOOL_QUEUE_MUTEX)) {
+        fprintf(stderr, "Invalid threadpool lanes, only the mutex queue has lanes\n");
+        return NULL;
+    }
+    for (int i = 0; i < config->num_lanes; i++) {
+        if (config->lanes[i].weight <= 0 || config->lanes[i].max_queued < 0) {
+            fprintf(stderr, "Invalid threadpool lanes\n");
+            return NULL;
+        }
+    }
+
+    // The ring cursors are cache-line aligned, so the pool must be as well
+    size_t pool_bytes = (sizeof(threadpool) + THREADPOOL_CACHE_LINE - 1) / THREADPOOL_CACHE_LINE * THREADPOOL_CACHE_LINE;
+    threadpool* pool = (threadpool*)aligned_alloc(THREADPOOL_CACHE_LINE, pool_bytes);
+    if (!pool) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(pool, 0, pool_bytes);
+
+    pool->num_threads = num_threads_in_pool;
+    pool->qsize = 0;
+    pool->max_qsize = max_queue_size;
+    pool->queue_kind = config->queue_kind;
+    pool->placement = config->placement;
+    pool->max_threads = max_threads;
+    pool->grow_wait_ms = config->grow_wait_ms;
+    pool->idle_timeout_ms = config->idle_timeout_ms;
+    pool->thread_start = config->thread_start;
+    pool->thread_start_arg = config->thread_start_arg;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * max_threads);
+    pool->thread_slots = (thread_slot*)calloc((size_t)max_threads, sizeof(thread_slot));
+    pool->num_lanes = config->num_lanes;
+    for (int i = 0; i < config->num_lanes; i++) {
+        pool->lanes[i].weight = config->lanes[i].weight;
+        pool->lanes[i].limit = config->lanes[i].max_queued;
+    }
+    pool->drr_lane = 0;
+    pool->drr_credit = pool->lanes[0].weight;
+    pool->work_slots = NULL;
+    pool->free_work = NULL;
+    if (pool->queue_kind == THREADPOOL_QUEUE_MUTEX) {
+        // The queue never holds more than max_queue_size jobs, so that many are enough
+        pool->work_slots = (work_t*)calloc((size_t)max_queue_size, sizeof(work_t));
+        for (int i = 0; pool->work_slots && i < max_queue_size; i++) {
+            pool->work_slots[i].next = pool->free_work;
+            pool->free_work = &pool->work_slots[i];
+        }
+    }
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->dont_accept, 0);
+    atomic_init(&pool->next_worker, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->work_seq, 0);
+    atomic_init(&pool->idle_workers, 0);
+    atomic_init(&pool->space_seq, 0);
+    atomic_init(&pool->blocked_producers, 0);
+    atomic_init(&pool->live_threads, 0);
+    atomic_init(&pool->grown, 0);
+    atomic_init(&pool->retired, 0);
+
+    if (!pool->threads || !pool->thread_slots ||
+        (pool->queue_kind == THREADPOOL_QUEUE_MUTEX && !pool->work_slots) ||
+        (pool->queue_kind == THREADPOOL_QUEUE_RING && init_ring(&pool->ring, max_queue_size) != 0) ||
+        (pool->queue_kind == THREADPOOL_QUEUE_STEAL && init_workers(pool) != 0)) {
+        perror("malloc");
+        free_workers(pool);
+        free(pool->work_slots);
+        free(pool->ring.slots);
+        free(pool->thread_slots);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < max_threads; i++) {
+        pool->thread_slots[i].pool = pool;
+        pool->thread_slots[i].index = i;
+        pool->thread_slots[i].state = THREAD_SLOT_FREE;
+    }
+
+    // Idle threads of an elastic pool wait on q_not_empty with a monotonic deadline
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+    if (pthread_mutex_init(&(pool->qlock), NULL) != 0 ||
+        pthread_mutex_init(&(pool->resize_lock), NULL) != 0 ||
+        pthread_cond_init(&(pool->q_not_empty), &monotonic) != 0 ||
+        pthread_cond_init(&(pool->q_empty), NULL) != 0 ||
+        pthread_cond_init(&(pool->q_not_full), NULL) != 0) {
+        perror("mutex or cond init");
+        pthread_condattr_destroy(&monotonic);
+        free_workers(pool);
+        free(pool->work_slots);
+        free(pool->ring.slots);
+        free(pool->thread_slots);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_condattr_destroy(&monotonic);
+
+    pthread_mutex_lock(&(pool->resize_lock));
+    for (int i = 0; i < num_threads_in_pool; i++) {
+        if (start_thread(pool, i) != 0) {
+            pthread_mutex_unlock(&(pool->resize_lock));
+            destroy_threadpool(pool);
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&(pool->resize_lock));
+
+    return pool;
+}
+
+/**
+ * Lock-free ring operations (bounded MPMC queue after D. Vyukov).
+ * A slot whose seq equals the producer's position is free; after the
+ * write it is published as position + 1 for the consumer, who hands it
+ * back as position + capacity for the next lap.
+ */
+static int ring_push(ring_queue* ring, dispatch_fn routine, void* arg, long enqueued_ms) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        ring_slot* slot = &ring->slots[pos % ring->capacity];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->routine = routine;
+                slot->arg = arg;
+                slot->enqueued_ms = enqueued_ms;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0) {
+            return 0; // full
+        }
+        else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int ring_pop(ring_queue* ring, dispatch_fn* routine, void** arg, long* enqueued_ms) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        ring_slot* slot = &ring->slots[pos % ring->capacity];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *routine = slot->routine;
+                *arg = slot->arg;
+                if (enqueued_ms) {
+                    *enqueued_ms = slot->enqueued_ms;
+                }
+                atomic_store_explicit(&slot->seq, pos + ring->capacity, memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0) {
+            return 0; // empty
+        }
+        else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int ring_size(ring_queue* ring) {
+    size_t head = atomic_load(&ring->dequeue_pos);
+    size_t tail = atomic_load(&ring->enqueue_pos);
+    return tail > head ? (int)(tail - head) : 0;
+}
+
+// A job was queued: wake one parked worker, if any
+static void signal_work(threadpool* pool) {
+    atomic_fetch_add(&pool->work_seq, 1);
+    if (atomic_load(&pool->idle_workers) > 0) {
+        futex_wake(&pool->work_seq, 1);
+    }
+}
+
+// A job was taken: let one parked dispatcher (or destroy_threadpool) retry
+static void signal_space(threadpool* pool) {
+    atomic_fetch_add(&pool->space_seq, 1);
+    if (atomic_load(&pool->blocked_producers) > 0) {
+        futex_wake(&pool->space_seq, 1);
+    }
+}
+
+static void dispatch_ring(threadpool* pool, dispatch_fn dispatch_to_here, void* arg) {
+    ring_queue* ring = &pool->ring;
+    long now = is_elastic(pool) ? monotonic_ms() : 0;
+
+    while (!ring_push(ring, dispatch_to_here, arg, now)) {
+        // A full queue is the clearest sign the pool is too small
+        if (is_elastic(pool)) {
+            grow_pool(pool);
+        }
+
+        // Full: park until a worker frees a slot. Re-checking after
+        // announcing ourselves closes the window for a lost wake-up.
+        unsigned int seq = atomic_load(&pool->space_seq);
+        atomic_fetch_add(&pool->blocked_producers, 1);
+        if (ring_push(ring, dispatch_to_here, arg, now)) {
+            atomic_fetch_sub(&pool->blocked_producers, 1);
+            break;
+        }
+        if (atomic_load(&pool->shutdown)) {
+            atomic_fetch_sub(&pool->blocked_producers, 1);
+            return;
+        }
+        futex_wait(&pool->space_seq, seq);
+        atomic_fetch_sub(&pool->blocked_producers, 1);
+    }
+
+    signal_work(pool);
+}
+
+static void run_ring_job(threadpool* pool, dispatch_fn routine, void* arg, long enqueued_ms) {
+    signal_space(pool);
+
+    // The job waited too long and the rest of the queue has nobody to take it
+    if (is_elastic(pool) && atomic_load(&pool->idle_workers) == 0 && ring_size(&pool->ring) > 0 &&
+        monotonic_ms() - enqueued_ms >= pool->grow_wait_ms) {
+        grow_pool(pool);
+    }
+    routine(arg);
+}
+
+static void* do_work_ring(threadpool* pool) {
+    ring_queue* ring = &pool->ring;
+    dispatch_fn routine;
+    void* arg;
+    long enqueued_ms;
+    long idle_since = 0;
+
+    while (1) {
+        if (ring_pop(ring, &routine, &arg, &enqueued_ms)) {
+            idle_since = 0;
+            run_ring_job(pool, routine, arg, enqueued_ms);
+            continue;
+        }
+
+        if (atomic_load(&pool->shutdown)) {
+            break;
+        }
+
+        // Surplus threads of an elastic pool retire after idling long enough
+        long budget = -1;
+        if (is_elastic(pool)) {
+            if (!idle_since) {
+                idle_since = monotonic_ms();
+            }
+            budget = idle_budget_ms(pool, idle_since);
+            if (budget == 0 && retire_thread(pool)) {
+                break;
+            }
+        }
+
+        // Empty: announce ourselves, look once more, then sleep on work_seq
+        unsigned int seq = atomic_load(&pool->work_seq);
+        atomic_fetch_add(&pool->idle_workers, 1);
+        if (ring_pop(ring, &routine, &arg, &enqueued_ms)) {
+            atomic_fetch_sub(&pool->idle_workers, 1);
+            idle_since = 0;
+            run_ring_job(pool, routine, arg, enqueued_ms);
+            continue;
+        }
+        if (!atomic_load(&pool->shutdown)) {
+            futex_wait_ms(&pool->work_seq, seq, budget);
+        }
+        atomic_fetch_sub(&pool->idle_workers, 1);
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Chase-Lev deque operations, with the C11 memory orderings from
+ * Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+ */
+static void deque_push(ws_deque* d, dispatch_fn routine, void* arg) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    ws_slot* slot = &d->slots[b & d->mask];
+    atomic_store_explicit(&slot->routine, routine, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg, arg, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static int deque_take(ws_deque* d, dispatch_fn* routine, void** arg) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return 0; // empty
+    }
+
+    ws_slot* slot = &d->slots[b & d->mask];
+    *routine = atomic_load_explicit(&slot->routine, memory_order_relaxed);
+    *arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    if (t < b) {
+        return 1;
+    }
+
+    // Last job: race the thieves for it
+    int won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                      memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+static int deque_steal(ws_deque* d, dispatch_fn* routine, void** arg) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return 0;
+    }
+
+    ws_slot* slot = &d->slots[t & d->mask];
+    dispatch_fn r = atomic_load_explicit(&slot->routine, memory_order_relaxed);
+    void* a = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return 0; // lost to the owner or another thief
+    }
+    *routine = r;
+    *arg = a;
+    return 1;
+}
+
+static long deque_size(ws_deque* d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+static ws_worker* pick_worker(threadpool* pool) {
+    unsigned int start = atomic_fetch_add_explicit(&pool->next_worker, 1, memory_order_relaxed);
+    ws_worker* best = &pool->workers[start % (unsigned int)pool->num_threads];
+    if (pool->placement == THREADPOOL_PLACE_ROUND_ROBIN) {
+        return best;
+    }
+
+    // Least loaded, scanning from the round-robin cursor to spread ties
+    long best_load = ring_size(&best->inbox) + deque_size(&best->deque);
+    for (int i = 1; i < pool->num_threads && best_load > 0; i++) {
+        ws_worker* w = &pool->workers[(start + (unsigned int)i) % (unsigned int)pool->num_threads];
+        long load = ring_size(&w->inbox) + deque_size(&w->deque);
+        if (load < best_load) {
+            best = w;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static void dispatch_steal(threadpool* pool, dispatch_fn dispatch_to_here, void* arg) {
+    // Reserve a place among the max_qsize jobs the pool may hold
+    while (1) {
+        int queued = atomic_load(&pool->queued);
+        if (queued < pool->max_qsize) {
+            if (atomic_compare_exchange_weak(&pool->queued, &queued, queued + 1)) {
+                break;
+            }
+            continue;
+        }
+
+        unsigned int seq = atomic_load(&pool->space_seq);
+        atomic_fetch_add(&pool->blocked_producers, 1);
+        if (atomic_load(&pool->queued) < pool->max_qsize) {
+            atomic_fetch_sub(&pool->blocked_producers, 1);
+            continue;
+        }
+        if (atomic_load(&pool->shutdown)) {
+            atomic_fetch_sub(&pool->blocked_producers, 1);
+            return;
+        }
+        futex_wait(&pool->space_seq, seq);
+        atomic_fetch_sub(&pool->blocked_producers, 1);
+    }
+
+    // Jobs spawned by a worker stay with it; the rest go to an inbox
+    ws_worker* self = current_worker;
+    if (self && self->pool == pool) {
+        deque_push(&self->deque, dispatch_to_here, arg);
+    }
+    else {
+        // The reservation guarantees room, but a consumer that has claimed
+        // a slot may not have released it yet
+        ws_worker* target = pick_worker(pool);
+        while (!ring_push(&target->inbox, dispatch_to_here, arg, 0)) {
+            sched_yield();
+        }
+    }
+
+    signal_work(pool);
+}
+
+static int find_work(ws_worker* self, dispatch_fn* routine, void** arg) {
+    threadpool* pool = self->pool;
+
+    if (deque_take(&self->deque, routine, arg)) {
+        return 1;
+    }
+
+    if (ring_pop(&self->inbox, routine, arg, NULL)) {
+        // Move a batch to the deque, where idle peers can steal it
+        dispatch_fn r;
+        void* a;
+        int moved = 0;
+        while (moved < STEAL_BATCH && ring_pop(&self->inbox, &r, &a, NULL)) {
+            deque_push(&self->deque, r, a);
+            moved++;
+        }
+        if (moved > 0) {
+            // The RMW in signal_work orders the pushes before the idle check
+            signal_work(pool);
+        }
+        return 1;
+    }
+
+    // Steal, starting from a random victim
+    self->rng = self->rng * 1103515245u + 12345u;
+    int start = (int)((self->rng >> 16) % (unsigned int)pool->num_threads);
+    for (int i = 0; i < pool->num_threads; i++) {
+        ws_worker* victim = &pool->workers[(start + i) % pool->num_threads];
+        if (victim == self) continue;
+        if (deque_steal(&victim->deque, routine, arg) || ring_pop(&victim->inbox, routine, arg, NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void run_stolen(threadpool* pool, dispatch_fn routine, void* arg) {
+    atomic_fetch_sub(&pool->queued, 1);
+    signal_space(pool);
+    routine(arg);
+}
+
+static void* do_work_steal(void* p) {
+    ws_worker* self = (ws_worker*)p;
+    threadpool* pool = self->pool;
+    dispatch_fn routine;
+    void* arg;
+
+    current_worker = self;
+    while (1) {
+        if (find_work(self, &routine, &arg)) {
+            run_stolen(pool, routine, arg);
+            continue;
+        }
+
+        if (atomic_load(&pool->shutdown)) {
+            break;
+        }
+
+        unsigned int seq = atomic_load(&pool->work_seq);
+        atomic_fetch_add(&pool->idle_workers, 1);
+        if (find_work(self, &routine, &arg)) {
+            atomic_fetch_sub(&pool->idle_workers, 1);
+            run_stolen(pool, routine, arg);
+            continue;
+        }
+        if (!atomic_load(&pool->shutdown)) {
+            futex_wait(&pool->work_seq, seq);
+        }
+        atomic_fetch_sub(&pool->idle_workers, 1);
+    }
+
+    current_worker = NULL;
+    pthread_exit(NULL);
+}
+
+static int lane_full(const work_lane* lane) {
+    return lane->limit > 0 && lane->size >= lane->limit;
+}
+
+// Enqueue time of the oldest job on any lane. Caller holds qlock.
+static long oldest_enqueued_ms(threadpool* pool) {
+    long oldest = 0;
+    for (int i = 0; i < pool->num_lanes; i++) {
+        work_t* head = pool->lanes[i].head;
+        if (head && (!oldest || head->enqueued_ms < oldest)) {
+            oldest = head->enqueued_ms;
+        }
+    }
+    return oldest;
+}
+
+void dispatch(threadpool* pool, dispatch_fn dispatch_to_here, void* arg) {
+    dispatch_lane(pool, 0, dispatch_to_here, arg);
+}
+
+void dispatch_lane(threadpool* pool, int lane_index, dispatch_fn dispatch_to_here, void* arg) {
+    if (!pool || pool->dont_accept || lane_index < 0 || lane_index >= pool->num_lanes) {
+        return;
+    }
+
+    if (pool->queue_kind == THREADPOOL_QUEUE_RING) {
+        dispatch_ring(pool, dispatch_to_here, arg);
+        return;
+    }
+    if (pool->queue_kind == THREADPOOL_QUEUE_STEAL) {
+        dispatch_steal(pool, dispatch_to_here, arg);
+        return;
+    }
+
+    long enqueued_ms = is_elastic(pool) ? monotonic_ms() : 0;
+
+    pthread_mutex_lock(&(pool->qlock));
+
+    // A full queue is the clearest sign the pool is too small
+    if (pool->qsize >= pool->max_qsize && is_elastic(pool)) {
+        pthread_mutex_unlock(&(pool->qlock));
+        grow_pool(pool);
+        pthread_mutex_lock(&(pool->qlock));
+    }
+
+    work_lane* lane = &pool->lanes[lane_index];
+    while ((pool->qsize >= pool->max_qsize || lane_full(lane)) && !pool->shutdown) {
+        pthread_cond_wait(&(pool->q_not_full), &(pool->qlock));
+    }
+
+    if (pool->shutdown) {
+        pthread_mutex_unlock(&(pool->qlock));
+        return;
+    }
+
+    // There is room in the queue, so a slot is free
+    work_t* work = pool->free_work;
+    pool->free_work = work->next;
+    work->routine = dispatch_to_here;
+    work->arg = arg;
+    work->enqueued_ms = enqueued_ms;
+    work->next = NULL;
+
+    if (lane->tail) {
+        lane->tail->next = work;
+    }
+    else {
+        lane->head = work;
+    }
+    lane->tail = work;
+    lane->size++;
+    pool->qsize++;
+
+    // Nobody is free and the oldest job has waited too long
+    int grow = is_elastic(pool) && atomic_load(&pool->idle_workers) == 0 &&
+               work->enqueued_ms - oldest_enqueued_ms(pool) >= pool->grow_wait_ms;
+
+    pthread_cond_signal(&(pool->q_not_empty));
+    pthread_mutex_unlock(&(pool->qlock));
+
+    if (grow) {
+        grow_pool(pool);
+    }
+}
+
+// Deficit round robin with one credit per job: the lane whose turn it is
+// hands out up to its weight in jobs, an empty lane gives up its turn.
+// Caller holds qlock and qsize > 0.
+static work_t* take_work(threadpool* pool) {
+    while (1) {
+        work_lane* lane = &pool->lanes[pool->drr_lane];
+        if (lane->head && pool->drr_credit > 0) {
+            work_t* work = lane->head;
+            lane->head = work->next;
+            if (!lane->head) {
+                lane->tail = NULL;
+            }
+            lane->size--;
+            pool->drr_credit--;
+            return work;
+        }
+        pool->drr_lane = (pool->drr_lane + 1) % pool->num_lanes;
+        pool->drr_credit = pool->lanes[pool->drr_lane].weight;
+    }
+}
+
+// Sleep on q_not_empty for at most timeout_ms (< 0 waits forever). Caller holds qlock.
+static void wait_not_empty(threadpool* pool, long timeout_ms) {
+    if (timeout_ms < 0) {
+        pthread_cond_wait(&(pool->q_not_empty), &(pool->qlock));
+        return;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&(pool->q_not_empty), &(pool->qlock), &deadline);
+}
+
+void* do_work(void* p) {
+    threadpool* pool = (threadpool*)p;
+
+    if (pool->queue_kind == THREADPOOL_QUEUE_RING) {
+        return do_work_ring(pool);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&(pool->qlock));
+
+        long idle_since = 0;
+        while (pool->qsize == 0 && !pool->shutdown) {
+            // Surplus threads of an elastic pool retire after idling long enough
+            long budget = -1;
+            if (is_elastic(pool)) {
+                if (!idle_since) {
+                    idle_since = monotonic_ms();
+                }
+                budget = idle_budget_ms(pool, idle_since);
+                if (budget == 0 && retire_thread(pool)) {
+                    pthread_mutex_unlock(&(pool->qlock));
+                    pthread_exit(NULL);
+                }
+            }
+
+            atomic_fetch_add(&pool->idle_workers, 1);
+            wait_not_empty(pool, budget);
+            atomic_fetch_sub(&pool->idle_workers, 1);
+        }
+
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&(pool->qlock));
+            pthread_exit(NULL);
+        }
+
+        int grow = 0;
+        work_t job = { NULL, NULL, 0, NULL };
+        work_t* work = pool->qsize > 0 ? take_work(pool) : NULL;
+        if (work) {
+            pool->qsize--;
+
+            if (pool->qsize == 0) {
+                pthread_cond_signal(&(pool->q_empty));
+            }
+
+            // The job waited too long and the rest of the queue has nobody to take it
+            grow = is_elastic(pool) && pool->qsize > 0 && atomic_load(&pool->idle_workers) == 0 &&
+                   monotonic_ms() - work->enqueued_ms >= pool->grow_wait_ms;
+
+            // Copy the job out so its slot can take the next dispatch
+            job = *work;
+            work->next = pool->free_work;
+            pool->free_work = work;
+        }
+
+        // With lanes the waiting dispatcher may need room in another lane
+        if (pool->num_lanes > 1) {
+            pthread_cond_broadcast(&(pool->q_not_full));
+        }
+        else {
+            pthread_cond_signal(&(pool->q_not_full));
+        }
+        pthread_mutex_unlock(&(pool->qlock));
+
+        if (grow) {
+            grow_pool(pool);
+        }
+
+        if (job.routine) {
+            job.routine(job.arg);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+int threadpool_queue_size(threadpool* pool) {
+    if (pool->queue_kind == THREADPOOL_QUEUE_RING) {
+        return ring_size(&pool->ring);
+    }
+    if (pool->queue_kind == THREADPOOL_QUEUE_STEAL) {
+        return atomic_load(&pool->queued);
+    }
+
+    pthread_mutex_lock(&(pool->qlock));
+    int qsize = pool->qsize;
+    pthread_mutex_unlock(&(pool->qlock));
+    return qsize;
+}
+
+int threadpool_lane_size(threadpool* pool, int lane) {
+    if (lane < 0 || lane >= pool->num_lanes) {
+        return 0;
+    }
+    if (pool->queue_kind != THREADPOOL_QUEUE_MUTEX) {
+        return threadpool_queue_size(pool);
+    }
+
+    pthread_mutex_lock(&(pool->qlock));
+    int size = pool->lanes[lane].size;
+    pthread_mutex_unlock(&(pool->qlock));
+    return size;
+}
+
+int threadpool_lane_full(threadpool* pool, int lane) {
+    // Limits are fixed at creation, so an unlimited lane needs no lock
+    if (lane < 0 || lane >= pool->num_lanes || pool->lanes[lane].limit == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(pool->qlock));
+    int full = lane_full(&pool->lanes[lane]);
+    pthread_mutex_unlock(&(pool->qlock));
+    return full;
+}
+
+void threadpool_get_stats(threadpool* pool, threadpool_stats* out) {
+    pthread_mutex_lock(&(pool->resize_lock));
+    out->threads = atomic_load(&pool->live_threads);
+    out->peak_threads = pool->peak_threads;
+    pthread_mutex_unlock(&(pool->resize_lock));
+
+    out->idle_threads = atomic_load(&pool->idle_workers);
+    out->min_threads = pool->num_threads;
+    out->max_threads = pool->max_threads;
+    out->queued = threadpool_queue_size(pool);
+    out->grown = atomic_load(&pool->grown);
+    out->retired = atomic_load(&pool->retired);
+}
+
+// Same drain-then-shutdown sequence as the mutex queue, with futexes
+static void drain_lockfree(threadpool* pool) {
+    atomic_fetch_add(&pool->blocked_producers, 1);
+    while (1) {
+        unsigned int seq = atomic_load(&pool->space_seq);
+        if (threadpool_queue_size(pool) == 0) {
+            break;
+        }
+        futex_wait(&pool->space_seq, seq);
+    }
+    atomic_fetch_sub(&pool->blocked_producers, 1);
+
+    atomic_store(&pool->shutdown, 1);
+    atomic_fetch_add(&pool->work_seq, 1);
+    futex_wake(&pool->work_seq, pool->max_threads);
+    atomic_fetch_add(&pool->space_seq, 1);
+    futex_wake(&pool->space_seq, MAXT_IN_POOL);
+}
+
+void destroy_threadpool(threadpool* pool) {
+    if (!pool) return;
+
+    if (pool->queue_kind != THREADPOOL_QUEUE_MUTEX) {
+        pool->dont_accept = 1;
+        drain_lockfree(pool);
+    }
+    else {
+        pthread_mutex_lock(&(pool->qlock));
+        pool->dont_accept = 1;
+
+        while (pool->qsize > 0) {
+            pthread_cond_wait(&(pool->q_empty), &(pool->qlock));
+        }
+
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&(pool->q_not_empty));
+        pthread_mutex_unlock(&(pool->qlock));
+    }
+
+    // shutdown is set, so grow_pool won't start threads behind our back
+    pthread_mutex_lock(&(pool->resize_lock));
+    pthread_mutex_unlock(&(pool->resize_lock));
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (pool->thread_slots[i].state != THREAD_SLOT_FREE) {
+            pthread_join(pool->threads[i], NULL);
+        }
+    }
+
+    free(pool->threads);
+    free(pool->thread_slots);
+    free(pool->work_slots);
+
+    pthread_mutex_destroy(&(pool->qlock));
+    pthread_mutex_destroy(&(pool->resize_lock));
+    pthread_cond_destroy(&(pool->q_not_empty));
+    pthread_cond_destroy(&(pool->q_empty));
+    pthread_cond_destroy(&(pool->q_not_full));
+    free_workers(pool);
+    free(pool->ring.slots);
+    free(pool);
+}
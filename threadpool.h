@@ -1,4 +1,9 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 /**
  * threadpool.h
@@ -11,32 +16,216 @@
 #define MAXT_IN_POOL 200
 #define MAXW_IN_QUEUE 200
 
+#define THREADPOOL_CACHE_LINE 64
+
+// most lanes a pool can be split into
+#define THREADPOOL_MAX_LANES 8
+
+// defaults for elastic pools (max_threads > num_threads)
+#define THREADPOOL_DEFAULT_GROW_WAIT_MS 10
+#define THREADPOOL_DEFAULT_IDLE_TIMEOUT_MS 30000
+
+/**
+ * Queue backends selectable at creation time
+ */
+typedef enum {
+    THREADPOOL_QUEUE_MUTEX,     //linked list of work_t guarded by qlock (default)
+    THREADPOOL_QUEUE_RING,      //preallocated lock-free ring, futex parking
+    THREADPOOL_QUEUE_STEAL      //per-worker deques, idle workers steal from peers
+} threadpool_queue_kind;
+
+/**
+ * Where THREADPOOL_QUEUE_STEAL puts jobs dispatched from outside the pool.
+ * Jobs dispatched by a worker always go to that worker's own deque.
+ */
+typedef enum {
+    THREADPOOL_PLACE_ROUND_ROBIN,
+    THREADPOOL_PLACE_LEAST_LOADED
+} threadpool_placement;
+
+/**
+ * One lane of THREADPOOL_QUEUE_MUTEX. Lanes take turns in deficit round
+ * robin: a lane with queued jobs hands out up to weight of them before
+ * the next lane's turn. max_queued caps the jobs waiting in the lane so
+ * a flood of one kind of job can't take the whole queue; 0 leaves only
+ * the pool's max_queue_size.
+ */
+typedef struct threadpool_lane_st {
+    int weight;
+    int max_queued;
+} threadpool_lane;
+
+/**
+ * Creation parameters for create_threadpool_with_config.
+ * Initialize with threadpool_config_init, then override fields.
+ */
+typedef struct threadpool_config_st {
+    int num_threads;            //threads started up front, the pool never shrinks below it
+    int max_queue_size;
+    threadpool_queue_kind queue_kind;
+    threadpool_placement placement;     //only used by THREADPOOL_QUEUE_STEAL
+    int max_threads;            //upper bound when growing, num_threads keeps the pool fixed
+    int grow_wait_ms;           //add a thread once a job waited this long with no idle thread
+    int idle_timeout_ms;        //retire a surplus thread idle for this long
+    void (*thread_start)(void*);    //run first on every worker thread, e.g. to pin it; NULL for none
+    void* thread_start_arg;
+    int num_lanes;              //1 keeps a single FIFO; more only with THREADPOOL_QUEUE_MUTEX
+    threadpool_lane lanes[THREADPOOL_MAX_LANES];
+} threadpool_config;
+
+/**
+ * Snapshot of the pool's size and resize history.
+ */
+typedef struct threadpool_stats_st {
+    int threads;                //threads running now
+    int idle_threads;           //threads waiting for work
+    int min_threads;
+    int max_threads;
+    int peak_threads;
+    int queued;                 //jobs waiting to be started
+    unsigned long grown;        //threads added beyond num_threads under load
+    unsigned long retired;      //surplus threads that exited after idling
+} threadpool_stats;
+
 /**
  * the pool holds a queue of this structure
  */
 typedef struct work_st{
     int (*routine) (void*);  //the threads process function
     void * arg;  //argument to the function
+    long enqueued_ms;   //monotonic time of dispatch, only set by elastic pools
     struct work_st* next;
 } work_t;
 
 
+/**
+ * The jobs queued on one lane of the mutex queue, oldest first
+ */
+typedef struct work_lane_st {
+    work_t* head;
+    work_t* tail;
+    int size;
+    int weight;
+    int limit;                  //max_queued of the lane, 0 for none
+} work_lane;
+
+/**
+ * One slot of the lock-free ring. seq tells producers and consumers
+ * whose turn the slot is; each slot has a cache line of its own.
+ */
+typedef struct ring_slot_st {
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_size_t seq;
+    int (*routine) (void*);
+    void * arg;
+    long enqueued_ms;
+} ring_slot;
+
+/**
+ * Bounded multi-producer/multi-consumer ring. It is the whole queue of
+ * THREADPOOL_QUEUE_RING and each worker's inbox in THREADPOOL_QUEUE_STEAL.
+ * Producer and consumer cursors live on separate cache lines so they
+ * don't bounce between cores.
+ */
+typedef struct ring_queue_st {
+    ring_slot* slots;           //preallocated slots
+    size_t capacity;
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_size_t dequeue_pos;
+} ring_queue;
+
+/**
+ * One slot of a work-stealing deque. A thief may read a slot while the
+ * owner reuses it; such a read is discarded because its CAS on top fails.
+ */
+typedef struct ws_slot_st {
+    _Atomic(int (*) (void*)) routine;
+    _Atomic(void *) arg;
+} ws_slot;
+
+/**
+ * Chase-Lev deque: the owning worker pushes and takes at bottom,
+ * thieves steal from top. Fixed capacity, never resized.
+ */
+typedef struct ws_deque_st {
+    ws_slot* slots;
+    long mask;                  //capacity - 1, capacity is a power of two
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_long top;
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_long bottom;
+} ws_deque;
+
+struct _threadpool_st;
+
+/**
+ * Per-worker state of THREADPOOL_QUEUE_STEAL. Jobs dispatched from
+ * outside the pool land in the inbox; the worker moves them to its
+ * deque in small batches where idle peers can steal them.
+ */
+typedef struct ws_worker_st {
+    ws_deque deque;
+    ring_queue inbox;
+    struct _threadpool_st* pool;
+    int index;
+    unsigned int rng;           //victim selection
+} ws_worker;
+
+/**
+ * A place for one pool thread. Elastic pools reuse the places of
+ * retired threads, which are joined before the place is taken again.
+ */
+typedef enum {
+    THREAD_SLOT_FREE,
+    THREAD_SLOT_RUNNING,
+    THREAD_SLOT_EXITED          //retired, waiting to be joined
+} thread_slot_state;
+
+typedef struct thread_slot_st {
+    struct _threadpool_st* pool;
+    int index;
+    thread_slot_state state;
+} thread_slot;
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
-    int num_threads;	//number of active threads
+    int num_threads;	//threads started at creation, the minimum of an elastic pool
     int qsize;	        //number in the queue
     int max_qsize;      //max number element in the queue
+    threadpool_queue_kind queue_kind;
     pthread_t *threads;	//pointer to threads
-    work_t* qhead;		//queue head pointer
-    work_t* qtail;		//queue tail pointer
+    work_lane lanes[THREADPOOL_MAX_LANES];     //the mutex queue, guarded by qlock
+    int num_lanes;
+    int drr_lane;               //lane whose turn it is
+    int drr_credit;             //jobs it may still hand out in this turn
+    work_t* work_slots;         //max_qsize preallocated work_t for the mutex queue
+    work_t* free_work;          //unused work_slots, guarded by qlock
     pthread_mutex_t qlock;		//lock on the queue list
     pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
     pthread_cond_t q_empty;
     pthread_cond_t q_not_full;      //full conditional variable
-    int shutdown;            //1 if the pool is in distruction process
-    int dont_accept;       //1 if destroy function has begun
+    atomic_int shutdown;            //1 if the pool is in distruction process
+    atomic_int dont_accept;       //1 if destroy function has begun
+    ring_queue ring;            //used instead of qhead/qtail with THREADPOOL_QUEUE_RING
+    ws_worker* workers;         //one per thread with THREADPOOL_QUEUE_STEAL
+    threadpool_placement placement;
+    atomic_uint next_worker;    //round-robin cursor
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_int queued;      //jobs waiting in inboxes and deques
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_uint work_seq;   //futex word bumped on every enqueue
+    atomic_int idle_workers;    //workers waiting for a job
+    _Alignas(THREADPOOL_CACHE_LINE) atomic_uint space_seq;  //futex word bumped on every dequeue
+    atomic_int blocked_producers;   //dispatchers parked on space_seq
+    int max_threads;            //size of threads and thread_slots
+    int grow_wait_ms;
+    int idle_timeout_ms;
+    void (*thread_start)(void*);
+    void* thread_start_arg;
+    thread_slot* thread_slots;
+    pthread_mutex_t resize_lock;    //protects thread_slots, peak_threads and the thread counts
+    atomic_int live_threads;    //threads started and not retired
+    int peak_threads;
+    long last_grow_ms;          //monotonic time a thread was last added
+    atomic_ulong grown;
+    atomic_ulong retired;
 } threadpool;
 
 
@@ -60,21 +249,80 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size);
 
+/**
+ * threadpool_config_init fills config with the defaults used by
+ * create_threadpool.
+ */
+void threadpool_config_init(threadpool_config* config, int num_threads_in_pool, int max_queue_size);
+
+/**
+ * create_threadpool_with_config creates a pool with the given queue
+ * backend. No backend allocates in dispatch: the mutex queue links
+ * preallocated work_t, the others copy jobs into preallocated slots.
+ * With THREADPOOL_QUEUE_RING and THREADPOOL_QUEUE_STEAL idle workers
+ * sleep on a futex instead of a condition variable. All backends keep the dispatch and
+ * destroy_threadpool semantics: dispatch blocks while max_queue_size
+ * jobs are waiting, destroy drains the queue before shutting down.
+ *
+ * With max_threads above num_threads the mutex and ring backends are
+ * elastic: a thread is added whenever a job waited grow_wait_ms for a
+ * worker while none was idle, and threads beyond num_threads exit after
+ * idle_timeout_ms without work. THREADPOOL_QUEUE_STEAL is always fixed.
+ *
+ * With num_lanes above 1 the mutex queue is split into lanes, see
+ * threadpool_lane; the lock-free backends have a single FIFO.
+ * Returns NULL on failure.
+ */
+threadpool* create_threadpool_with_config(const threadpool_config* config);
+
+/**
+ * threadpool_get_stats copies the current thread counts and resize
+ * counters into out. Safe to call from any thread.
+ */
+void threadpool_get_stats(threadpool* pool, threadpool_stats* out);
+
+/**
+ * threadpool_queue_size returns the number of queued (not yet started)
+ * jobs. The value is a snapshot and may be stale immediately.
+ */
+int threadpool_queue_size(threadpool* pool);
+
+/**
+ * threadpool_lane_size returns the number of jobs queued on lane, a
+ * snapshot like threadpool_queue_size. Lane 0 of a pool without lanes
+ * is the whole queue.
+ */
+int threadpool_lane_size(threadpool* pool, int lane);
+
+/**
+ * threadpool_lane_full returns 1 if lane holds its max_queued jobs, so
+ * dispatch_lane would wait. A lane without a limit is never full.
+ */
+int threadpool_lane_full(threadpool* pool, int lane);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
  * when an available thread takes a job from the queue, it will
  * call the function "dispatch_to_here" with argument "arg".
  * this function should:
- * 1. create and init work_t element
- * 2. lock the mutex
- * 3. if queue is full, wait
+ * 1. lock the mutex
+ * 2. if queue is full, wait
+ * 3. take a free work_t element and init it
  * 4. add the work_t element to the queue
  * 5. unlock mutex
  *
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_lane is dispatch onto one lane of the pool; dispatch uses
+ * lane 0. Besides waiting while the whole queue is full it waits while
+ * the lane holds its max_queued jobs. A lane the pool doesn't have is
+ * ignored, like a dispatch during destruction.
+ */
+void dispatch_lane(threadpool* from_me, int lane, dispatch_fn dispatch_to_here, void *arg);
+
 /**
  * The work function of the thread
  * this function should:
@@ -95,4 +343,4 @@ void* do_work(void* p);
  */
 void destroy_threadpool(threadpool* destroyme);
 
-
+#endif
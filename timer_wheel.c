@@ -0,0 +1,122 @@
+//NOAM
+
+#include <string.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_SPAN (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static void push(timer_entry** slot, timer_entry* t) {
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot) {
+        (*slot)->prev = t;
+    }
+    *slot = t;
+}
+
+static void unlink_entry(timer_entry* t) {
+    if (t->prev) {
+        t->prev->next = t->next;
+    }
+    else {
+        *t->slot = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    t->slot = NULL;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+// The lowest level whose span reaches the deadline; its slot is taken
+// from the absolute tick, so a slot only ever holds one lap of deadlines
+static void insert(timer_wheel* w, timer_entry* t) {
+    if (t->expires < w->now) {
+        t->expires = w->now;
+    }
+    uint64_t delta = t->expires - w->now;
+    if (delta > MAX_SPAN) {
+        t->expires = w->now + MAX_SPAN;
+        delta = MAX_SPAN;
+    }
+
+    int level = 0;
+    while ((delta >> (TIMER_WHEEL_BITS * (level + 1))) != 0) {
+        level++;
+    }
+    int index = (int)((t->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    push(&w->slots[level][index], t);
+}
+
+void timer_wheel_init(timer_wheel* w, uint64_t now_ms, unsigned int tick_ms) {
+    memset(w, 0, sizeof(timer_wheel));
+    w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    w->now = now_ms / w->tick_ms;
+}
+
+void timer_wheel_schedule(timer_wheel* w, timer_entry* t, uint64_t when_ms) {
+    uint64_t expires = (when_ms + w->tick_ms - 1) / w->tick_ms;
+    if (t->slot) {
+        if (t->expires == expires) {
+            return;
+        }
+        unlink_entry(t);
+        w->count--;
+    }
+    t->expires = expires;
+    insert(w, t);
+    w->count++;
+}
+
+void timer_wheel_cancel(timer_wheel* w, timer_entry* t) {
+    if (t->slot) {
+        unlink_entry(t);
+        w->count--;
+    }
+}
+
+int timer_wheel_scheduled(const timer_entry* t) {
+    return t->slot != NULL;
+}
+
+// Spreads one slot of a higher level over the levels below it.
+// Returns the slot index, 0 when that level wrapped around as well.
+static int cascade(timer_wheel* w, int level) {
+    int index = (int)((w->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    timer_entry* list = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    while (list) {
+        timer_entry* t = list;
+        list = t->next;
+        insert(w, t);
+    }
+    return index;
+}
+
+void timer_wheel_advance(timer_wheel* w, uint64_t now_ms, timer_fn fire, void* ctx) {
+    uint64_t target = now_ms / w->tick_ms;
+    while (w->now <= target) {
+        int index = (int)(w->now & SLOT_MASK);
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && cascade(w, level) == 0; level++) {
+            }
+        }
+
+        // Detached first, so a timer fire schedules for now lands in the next tick
+        timer_entry* expired = w->slots[0][index];
+        w->slots[0][index] = NULL;
+        w->now++;
+        for (timer_entry* t = expired; t; t = t->next) {
+            t->slot = &expired;
+        }
+        while (expired) {
+            timer_entry* t = expired;
+            unlink_entry(t);
+            w->count--;
+            fire(t, ctx);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/**
+ * timer_wheel.h
+ *
+ * Hierarchical timing wheel for connection deadlines. Time is counted in
+ * ticks of tick_ms milliseconds. Level 0 has one slot per tick for the
+ * next TIMER_WHEEL_SLOTS ticks; every further level covers
+ * TIMER_WHEEL_SLOTS times the span of the one below it, and its slots are
+ * moved down a level when the level below wraps around. Scheduling and
+ * cancelling are O(1) whatever the number of timers, which matters when
+ * every connection carries a deadline that moves on each request.
+ *
+ * Timers fire at the first advance at or after their deadline, rounded up
+ * to a whole tick. A wheel is used by one thread only.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4    //2^24 ticks, about 19 days at the reactor's 100 ms tick; later deadlines are cut to that
+
+/**
+ * A timer, embedded in the object it belongs to. Zero it, or schedule it
+ * once, before cancelling it.
+ */
+typedef struct timer_entry_st {
+    uint64_t expires;               //tick the timer fires at
+    struct timer_entry_st** slot;   //list it is in, NULL while not scheduled
+    struct timer_entry_st* prev;
+    struct timer_entry_st* next;
+} timer_entry;
+
+typedef struct timer_wheel_st {
+    unsigned int tick_ms;
+    uint64_t now;                   //next tick to run
+    int count;                      //timers scheduled
+    timer_entry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * Called for each expired timer, which is no longer scheduled and may be
+ * scheduled again.
+ */
+typedef void (*timer_fn)(timer_entry* t, void* ctx);
+
+/**
+ * timer_wheel_init sets up an empty wheel whose clock starts at now_ms.
+ */
+void timer_wheel_init(timer_wheel* w, uint64_t now_ms, unsigned int tick_ms);
+
+/**
+ * timer_wheel_schedule makes t fire at when_ms, rescheduling it if it
+ * was already scheduled. A deadline that has passed fires on the next
+ * advance.
+ */
+void timer_wheel_schedule(timer_wheel* w, timer_entry* t, uint64_t when_ms);
+
+/**
+ * timer_wheel_cancel unschedules t. Does nothing if it isn't scheduled.
+ */
+void timer_wheel_cancel(timer_wheel* w, timer_entry* t);
+
+/**
+ * timer_wheel_scheduled returns 1 if t is scheduled.
+ */
+int timer_wheel_scheduled(const timer_entry* t);
+
+/**
+ * timer_wheel_advance moves the clock to now_ms and calls fire for every
+ * timer that expired on the way. fire may schedule and cancel timers.
+ */
+void timer_wheel_advance(timer_wheel* w, uint64_t now_ms, timer_fn fire, void* ctx);
+
+#endif
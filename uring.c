@@ -0,0 +1,316 @@
+//NOAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define FIXED_SOCKET 0
+#define FIXED_FILE 1
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static int supported = 0;
+static pthread_key_t ring_key;
+
+static int uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void destroy_uring(uring* u) {
+    if (!u) {
+        return;
+    }
+    if (u->buffers) munmap(u->buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+    if (u->sqes) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0) close(u->fd);
+    free(u);
+}
+
+static void* map_ring(int fd, size_t size, off_t offset) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static uring* create_uring(void) {
+    uring* u = (uring*)calloc(1, sizeof(uring));
+    if (!u) {
+        return NULL;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    // Without fast poll a send to a full non-blocking socket fails with EAGAIN
+    if (u->fd < 0 || !(p.features & IORING_FEAT_FAST_POLL)) {
+        destroy_uring(u);
+        return NULL;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->sq_ring = map_ring(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+        u->cq_ring = u->sq_ring;
+    }
+    else {
+        u->sq_ring = map_ring(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+        u->cq_ring = map_ring(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)map_ring(u->fd, u->sqes_size, IORING_OFF_SQES);
+    if (!u->sq_ring || !u->cq_ring || !u->sqes) {
+        destroy_uring(u);
+        return NULL;
+    }
+
+    char* sq = (char*)u->sq_ring;
+    char* cq = (char*)u->cq_ring;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Registered once, the buffers are not pinned and unpinned on every read
+    void* buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        destroy_uring(u);
+        return NULL;
+    }
+    u->buffers = (char*)buffers;
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = u->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    // Two empty fixed-file slots, filled by every send with its socket and file
+    int files[2] = { -1, -1 };
+    if (uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0 ||
+        uring_register(u->fd, IORING_REGISTER_FILES, files, 2) < 0) {
+        destroy_uring(u);
+        return NULL;
+    }
+    return u;
+}
+
+static void probe(void) {
+    uring* u = create_uring();
+    if (!u) {
+        return;
+    }
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* pr = (struct io_uring_probe*)calloc(1, size);
+    if (pr && uring_register(u->fd, IORING_REGISTER_PROBE, pr, 256) == 0) {
+        static const int needed[] = {
+            IORING_OP_FILES_UPDATE, IORING_OP_SENDMSG, IORING_OP_READ_FIXED, IORING_OP_SEND,
+            IORING_OP_LINK_TIMEOUT
+        };
+        supported = 1;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > pr->last_op || !(pr->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(pr);
+    destroy_uring(u);
+
+    if (supported) {
+        pthread_key_create(&ring_key, (void (*)(void*))destroy_uring);
+    }
+}
+
+int uring_supported(void) {
+    pthread_once(&probe_once, probe);
+    return supported;
+}
+
+uring* uring_for_thread(void) {
+    if (!uring_supported()) {
+        return NULL;
+    }
+    uring* u = (uring*)pthread_getspecific(ring_key);
+    if (!u && (u = create_uring()) != NULL) {
+        pthread_setspecific(ring_key, u);
+    }
+    return u;
+}
+
+// Next free submission entry, linked to the one after it. user_data holds
+// the opcode in its upper half and the result expected in the lower one.
+static struct io_uring_sqe* next_sqe(uring* u, unsigned* tail, int op, int fd, uint64_t expect) {
+    unsigned index = *tail & u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_IO_LINK | (fd >= 0 ? IOSQE_FIXED_FILE : 0);
+    sqe->user_data = ((uint64_t)op << 32) | expect;
+    u->sq_array[index] = index;
+    (*tail)++;
+    return sqe;
+}
+
+// Bounds the send just before it by an absolute CLOCK_MONOTONIC time; it
+// completes with -ECANCELED if the send finished in time and with -ETIME
+// if it cancelled the send
+static struct io_uring_sqe* link_timeout(uring* u, unsigned* tail, const struct __kernel_timespec* ts) {
+    struct io_uring_sqe* sqe = next_sqe(u, tail, IORING_OP_LINK_TIMEOUT, -1, 0);
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    return sqe;
+}
+
+ssize_t uring_send_file(uring* u, int sock, const struct iovec* head, int head_cnt,
+                        int file_fd, off_t offset, size_t count, uint64_t deadline_ns, size_t min_rate) {
+    int files[2] = { sock, file_fd };
+    static const int no_files[2] = { -1, -1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)head;
+    msg.msg_iovlen = (size_t)head_cnt;
+    size_t head_len = 0;
+    for (int i = 0; i < head_cnt; i++) {
+        head_len += head[i].iov_len;
+    }
+
+    size_t sent = 0;
+    int first = 1;
+    while (first || sent < count) {
+        unsigned tail = *u->sq_tail;
+        unsigned start = tail;
+        struct io_uring_sqe* sqe = NULL;
+
+        // Each round's deadline moves by what the peer took of the rounds
+        // before it, leaving out what still sits in the send queue
+        uint64_t round_deadline = deadline_ns;
+        int queued = 0;
+        if (min_rate > 0 && sent > 0 && ioctl(sock, SIOCOUTQ, &queued) == 0) {
+            size_t taken = sent > (size_t)queued ? sent - (size_t)queued : 0;
+            round_deadline += taken / min_rate * 1000000000ull + taken % min_rate * 1000000000ull / min_rate;
+        }
+        struct __kernel_timespec ts = { (long long)(round_deadline / 1000000000ull),
+                                        (long long)(round_deadline % 1000000000ull) };
+
+        sqe = next_sqe(u, &tail, IORING_OP_FILES_UPDATE, -1, 2);
+        sqe->addr = (uintptr_t)files;
+        sqe->len = 2;
+        sqe->off = FIXED_SOCKET;
+        if (first) {
+            sqe = next_sqe(u, &tail, IORING_OP_SENDMSG, FIXED_SOCKET, head_len);
+            sqe->addr = (uintptr_t)&msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            if (deadline_ns > 0) {
+                sqe = link_timeout(u, &tail, &ts);
+            }
+        }
+        size_t pos = sent;
+        for (int k = 0; k < URING_BUFFERS && pos < count; k++) {
+            size_t len = count - pos < URING_BUFFER_SIZE ? count - pos : URING_BUFFER_SIZE;
+            char* buf = u->buffers + (size_t)k * URING_BUFFER_SIZE;
+            sqe = next_sqe(u, &tail, IORING_OP_READ_FIXED, FIXED_FILE, len);
+            sqe->addr = (uintptr_t)buf;
+            sqe->len = (unsigned)len;
+            sqe->off = (uint64_t)(offset + (off_t)pos);
+            sqe->buf_index = (uint16_t)k;
+            sqe = next_sqe(u, &tail, IORING_OP_SEND, FIXED_SOCKET, len);
+            sqe->addr = (uintptr_t)buf;
+            sqe->len = (unsigned)len;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            if (deadline_ns > 0) {
+                sqe = link_timeout(u, &tail, &ts);
+            }
+            pos += len;
+        }
+        sqe->flags &= (uint8_t)~IOSQE_IO_LINK;     // the chain ends here
+
+        // The table holds references: empty it once the chain is over, or
+        // closing the socket would not close the connection
+        sqe = next_sqe(u, &tail, IORING_OP_FILES_UPDATE, -1, 2);
+        sqe->addr = (uintptr_t)no_files;
+        sqe->len = 2;
+        sqe->off = FIXED_SOCKET;
+        sqe->flags = IOSQE_IO_DRAIN;
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // One enter submits the round and waits for all of it
+        unsigned submitted = tail - start;
+        unsigned to_submit = submitted;
+        unsigned completed = 0;
+        int failed = 0;
+        int timed_out = 0;
+        int short_read = 0;
+        while (completed < submitted) {
+            unsigned cq_head = *u->cq_head;
+            unsigned cq_tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+            for (; cq_head != cq_tail; cq_head++, completed++) {
+                struct io_uring_cqe* cqe = &u->cqes[cq_head & u->cq_mask];
+                int op = (int)(cqe->user_data >> 32);
+                int64_t expect = (int64_t)(cqe->user_data & 0xffffffffu);
+                if (op == IORING_OP_SEND && cqe->res > 0) {
+                    sent += (size_t)cqe->res;
+                }
+                if (cqe->res == expect) continue;
+                if (op == IORING_OP_LINK_TIMEOUT) {
+                    timed_out |= cqe->res == -ETIME;
+                }
+                else if (op == IORING_OP_READ_FIXED || (op == IORING_OP_SEND && cqe->res == -ECANCELED)) {
+                    short_read = 1;     // the rest of the chain was cancelled after it
+                }
+                else {
+                    failed = 1;
+                }
+            }
+            __atomic_store_n(u->cq_head, cq_head, __ATOMIC_RELEASE);
+
+            if (completed < submitted) {
+                int rc = uring_enter(u->fd, to_submit, submitted - completed, IORING_ENTER_GETEVENTS);
+                if (rc < 0 && errno != EINTR) {
+                    return -1;
+                }
+                if (rc > 0) {
+                    to_submit -= (unsigned)rc < to_submit ? (unsigned)rc : to_submit;
+                }
+            }
+        }
+
+        if (timed_out) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (failed) {
+            return -1;
+        }
+        if (short_read) {
+            return (ssize_t)sent;
+        }
+        first = 0;
+    }
+    return (ssize_t)sent;
+}
@@ -0,0 +1,78 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * uring.h
+ *
+ * Optional io_uring path for sending a response head and a file body.
+ * The whole response is one chain of linked submissions: install the
+ * socket and the file as fixed files, send the head, then read the file
+ * into registered buffers and send each one. A last submission, drained
+ * behind the chain, empties the fixed-file slots again. It takes a single
+ * io_uring_enter() per URING_BUFFERS buffers instead of a sendfile() (and
+ * possibly a poll()) per chunk. The rings are set up with the raw system
+ * calls; liburing is not needed.
+ *
+ * Each thread has a ring of its own, made on first use and torn down
+ * when the thread exits.
+ */
+
+#define URING_BUFFERS 8                 //registered buffers per ring
+#define URING_BUFFER_SIZE (64 * 1024)
+#define URING_ENTRIES 32                //enough for a whole round: 4 + 3 * URING_BUFFERS
+
+typedef struct uring_st {
+    int fd;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;                  //mmap()ed regions, kept for munmap()
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    char* buffers;                  //URING_BUFFERS * URING_BUFFER_SIZE bytes, registered
+} uring;
+
+/**
+ * uring_supported reports whether the kernel lets this process create a
+ * ring with every operation the send path uses. The first call probes,
+ * later calls return the cached answer.
+ */
+int uring_supported(void);
+
+/**
+ * uring_for_thread returns the calling thread's ring, creating it on the
+ * first call. Returns NULL if it can't be created; the caller then uses
+ * the plain system calls.
+ */
+uring* uring_for_thread(void);
+
+/**
+ * uring_send_file sends the head (head_cnt iovecs) and then count bytes
+ * of file_fd from offset to the socket sock, blocking until done.
+ * Returns the number of body bytes sent, which is less than count if a
+ * read fell short (the file shrank or the read would have blocked) and
+ * the caller should send the rest another way. Returns -1 if the head
+ * or a send failed; the connection is then unusable. With deadline_ns > 0
+ * every send carries a linked timeout at that CLOCK_MONOTONIC time, moved
+ * a second later for every min_rate body bytes the peer has taken (if
+ * min_rate > 0), and a send still unfinished by then fails with errno
+ * ETIMEDOUT.
+ */
+ssize_t uring_send_file(uring* u, int sock, const struct iovec* head, int head_cnt,
+                        int file_fd, off_t offset, size_t count, uint64_t deadline_ns, size_t min_rate);
+
+#endif